@@ -66,19 +66,59 @@
 #define __u64 uint64_t
 
 #define EXT4_EH_MAGIC	0xf30a
+#define EXT4_SUPER_MAGIC	0xef53
 
 #define EXT4_READ 0
 #define EXT4_WRITE 1
 
-/* we can use mkfs.ext4 -b option to specify the block size, here I set it to 1024 bytes, see manual */
-#define EXT4_BLOCK_SIZE			1024
-/* the max counts of block group*/
-#define EXT4_MAX_BG_CNT			10
+/* we can use mkfs.ext4 -b option to specify the block size, see manual.
+  It is taken from s_log_block_size at mount (ext4_mount), 1K to 64K are supported */
+#define EXT4_MIN_BLOCK_SIZE		1024
+#define EXT4_MAX_BLOCK_SIZE		65536
+#define EXT4_BLOCK_SIZE			ext4_block_size
+#define EXT4_BLOCK_SIZE_BITS		ext4_block_bits
+/* the size of a group descriptor without the 64bit feature */
+#define EXT4_MIN_DESC_SIZE		32
+
+/* the max counts of blocks transferred by one ext4_rw_ondisk_blocks request */
+#define EXT4_MAX_RW_BLOCKS		64
+/* the max counts of blocks read by one batch of ext4_rw_ondisk_blocks requests */
+#define EXT4_BATCH_BLOCKS		256
+
+/* the max counts of inode table blocks read at once by the inode table scan */
+#define EXT4_ISCAN_BLOCKS		64
+
+/* the counts of checksums verified with one crc32c_batch */
+#define EXT4_CSUM_BATCH			32
+
+/* the orders of the buddy summaries of free blocks, a group has up to
+  8 * EXT4_MAX_BLOCK_SIZE = 2^19 blocks */
+#define EXT4_MB_ORDERS			20
+
+/* the seconds the super block and group descriptors may stay dirty in memory
+  before they are committed at the end of an allocation */
+#define EXT4_COMMIT_INTERVAL		5
+
+/* the delayed blocks of all the files kept in memory before they are flushed */
+#define EXT4_DA_MAX_BLOCKS		4096
+
+/* the blocks preallocated behind a new run of a file, if the super block
+  does not say (s_prealloc_blocks, s_prealloc_dir_blocks) */
+#define EXT4_DEFAULT_PREALLOC_BLOCKS	8
+/* the windows grow with the file up to this size in bytes */
+#define EXT4_MAX_PREALLOC_SIZE		(8 << 20)
+
+/* the counts of in-memory inodes in the inode cache */
+#define EXT4_NINODE			128
+
+/* the window of readahead of data blocks, it grows from MIN to MAX on sequential reads */
+#define EXT4_RA_MIN_BLOCKS		8
+#define EXT4_RA_MAX_BLOCKS		64
 
 /* convert block counts to sector counts, one ext4 block size equals to ? physical sector size */
 #define EXT4_BLOCK2SECTOR_CNT		EXT4_BLOCK_SIZE / SECTOR_SIZE
 
-#define EXT4_BLOCKNO2SECTORNO(num)	num*EXT4_BLOCK2SECTOR_CNT
+#define EXT4_BLOCKNO2SECTORNO(num)	((uint64_t)(num)*(EXT4_BLOCK2SECTOR_CNT))
 
 #define EXT4_LABEL_MAX			16
 
@@ -101,6 +141,8 @@
 /* the inode number of root directory, the i_flags of root inode = 0x80000
 	means it use extents, I'm not sure if it's a common case. */
 #define EXT4_ROOT_DIR_INODE_NUM 2
+/* the size of the inodes of ext2, the i_extra_isize bytes follow them */
+#define EXT4_GOOD_OLD_INODE_SIZE 128
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -388,6 +430,20 @@ struct ext4_group_desc
 	__u32   bg_reserved;
 };
 
+/* bg_flags */
+#define EXT4_BG_INODE_UNINIT	0x0001 /* Inode table/bitmap not in use */
+#define EXT4_BG_BLOCK_UNINIT	0x0002 /* Block bitmap not in use */
+#define EXT4_BG_INODE_ZEROED	0x0004 /* On-disk itable initialized to zero */
+
+/* s_feature_ro_compat, bg_itable_unused_lo and bg_flags are valid with
+  either GDT_CSUM or METADATA_CSUM */
+#define EXT4_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT		0x0080
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED		0x2000
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM		0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM	0x0400
+
 /*
  * This is the extent tail on-disk structure.
  * All other extent structures are 12 bytes long.  It turns out that
@@ -410,6 +466,11 @@ struct ext4_extent {
 	__le32	ee_start_lo;	/* low 32 bits of physical block */
 };
 
+/* the length of an extent, ee_len > 32768 means an uninitialized extent */
+#define EXT4_INIT_MAX_LEN	(1 << 15)
+#define EXT4_EXT_LEN(pextent)	((pextent)->ee_len > EXT4_INIT_MAX_LEN ? \
+				 (pextent)->ee_len - EXT4_INIT_MAX_LEN : (pextent)->ee_len)
+
 /*
  * This is index on-disk structure.
  * It's used at all the levels except the bottom.
@@ -447,6 +508,90 @@ struct ext4_dir_entry_2 {
 	char name[EXT4_NAME_LEN]; /* File name */
 };
 
+/*
+ * The phony dir entry at the end of a directory leaf block, which holds
+ * its checksum with metadata_csum.
+ */
+struct ext4_dir_entry_tail {
+	__le32	det_reserved_zero1;	/* Pretend to be unused */
+	__le16	det_rec_len;		/* 12 */
+	__u8	det_reserved_zero2;	/* Zero name length */
+	__u8	det_reserved_ft;	/* 0xDE, fake file type */
+	__le32	det_checksum;		/* crc32c(uuid+inum+dirblock) */
+};
+
+/*
+ * Readahead state of a stream of data block reads, zero it before the first read.
+ */
+struct ext4_ra {
+	__u32	next_lblk;	/* the logical block expected to be read next */
+	__u32	start;		/* the physical blocks [start, end) are read ahead */
+	__u32	end;
+	__u32	window;		/* blocks to read ahead in the next window */
+};
+
+/*
+ * The summary of the file system, see ext4_statfs.
+ */
+struct ext4_statfs {
+	__u32	f_bsize;	/* the block size */
+	__u64	f_blocks;	/* the blocks for data and metadata */
+	__u64	f_bfree;	/* free blocks, less the ones reserved by delayed allocation */
+	__u64	f_bavail;	/* free blocks for the users other than root */
+	__u32	f_files;
+	__u32	f_ffree;
+	__u32	f_dirs;		/* directories in use */
+};
+
+/*
+ * In-memory copy of an on-disk inode, kept in the inode cache.
+ */
+struct ext4_minode {
+	__u32	ino;		/* inode number, 0 if the slot is unused */
+	int	ref;		/* counts of ext4_iget without ext4_iput */
+	int	dirty;		/* d differs from the inode table */
+	struct sleeplock lock;	/* protects d */
+	struct ext4_minode *hnext;	/* hash chain */
+	struct ext4_minode *prev;	/* LRU list */
+	struct ext4_minode *next;
+	struct ext4_inode d;
+};
+
+/*
+ * State of a scan of all the in-use inodes, see ext4_iscan_next.
+ */
+struct ext4_iscan {
+	__u32	group;		/* the group being scanned */
+	__u32	idx;		/* the index in the group of the next inode */
+	__u32	nused;		/* inodes [0, nused) of the group may be in use */
+	__u32	start;		/* inodes [start, end) of the group are in itable */
+	__u32	end;
+	uint8_t	*bitmap;	/* the resident inode bitmap of the group */
+	uint8_t	*itable;	/* EXT4_ISCAN_BLOCKS blocks of the inode table */
+	uint8_t	*itable_buff;
+	uint8_t	*csum_buff;	/* EXT4_CSUM_BATCH inodes being verified */
+	struct ext4_inode inode;	/* the copy of the inode returned last */
+};
+
+extern uint32_t ext4_block_size;
+extern uint32_t ext4_block_bits;
+
+/*
+ * Call fn(bs, ...) with the block size bs as a compile time constant for the
+ * common block sizes, so that the hot loops in fn (an inline function) are
+ * specialized for each of them.
+ */
+#define EXT4_SPECIALIZE_BLOCK_SIZE(fn, ...)			\
+	do {							\
+		switch(EXT4_BLOCK_SIZE){			\
+		case 1024:  fn(1024, __VA_ARGS__); break;	\
+		case 2048:  fn(2048, __VA_ARGS__); break;	\
+		case 4096:  fn(4096, __VA_ARGS__); break;	\
+		case 65536: fn(65536, __VA_ARGS__); break;	\
+		default: fn(EXT4_BLOCK_SIZE, __VA_ARGS__); break;	\
+		}						\
+	} while(0)
+
 typedef struct ext4_super_block ext4_super_block_t;
 typedef struct ext4_group_desc ext4_group_desc_t;
 typedef struct ext4_inode	ext4_inode_t;
@@ -455,12 +600,37 @@ typedef struct ext4_extent_idx ext4_extent_idx_t;
 typedef struct ext4_extent ext4_extent_t;
 typedef struct ext4_extent_tail ext4_extent_tail_t;
 typedef struct ext4_dir_entry_2	ext4_dir_entry_2_t;
+typedef struct ext4_dir_entry_tail	ext4_dir_entry_tail_t;
+typedef struct ext4_minode	ext4_minode_t;
 
 int ext4_fill_super();
+int ext4_mount(uint32_t dev, const char *path, int flags);
+void ext4_umount();
 void ext4_rw_ondisk_inode(int inode_num, ext4_inode_t *pinode, int rw);
+ext4_minode_t *ext4_iget(__u32 ino);
+void ext4_iput(ext4_minode_t *ip);
+void ext4_idirty(ext4_minode_t *ip);
+int ext4_isync();
+int ext4_bitmap_sync();
+void ext4_iscan_start(struct ext4_iscan *s);
+ext4_inode_t *ext4_iscan_next(struct ext4_iscan *s, __u32 *ino);
+void ext4_iscan_end(struct ext4_iscan *s);
 int ext4_readdir(ext4_inode_t *pinode, int offset, void *buf, int len);
+int ext4_find_extent(ext4_inode_t *pinode, __u32 lblk, ext4_extent_t *pextent);
+int ext4_read(__u32 ino, struct ext4_ra *ra, uint64_t off, void *buf, int len);
+int ext4_write(__u32 ino, uint64_t off, const void *buf, int len);
+int ext4_da_flush(__u32 ino);
+int ext4_da_sync();
+void ext4_da_drop(__u32 ino);
+void ext4_pa_discard(__u32 ino);
 ext4_inode_t *ext4_create_inode(ext4_inode_t *parent_inode, int type);
 int ext4_rw_ondisk_super_bgd(int rw);
+int ext4_sb_commit();
+void ext4_sync();
+void ext4_statfs(struct ext4_statfs *st);
 void ext4_rw_ondisk_block(int blockno, void *buff, int rw);
+void ext4_rw_ondisk_blocks(int blockno, int cnt, void *buff, int rw);
+void ext4_rw_ondisk_blocks_vec(int blockno, int cnt, void **buffs, int rw);
+void *ext4_map_blocks(int blockno, int cnt, void *buff);
 
 #endif	/* _EXT4_H */
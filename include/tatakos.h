@@ -11,6 +11,9 @@
 #define _BIO_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/types.h>
 
 #define SECTOR_SIZE BSIZE
 /* to make it portable to tatakos */
@@ -31,20 +34,40 @@
 #define rd(str) 	"\e[31;1m"str"\e[0m"
 #define bl(str) 	"\e[34;1m"str"\e[0m"
 
+/* the default counts of buffers in the buffer cache, see binit */
+#define NBUF 128
+/* the max counts of blocks brought into the cache by one breadahead */
+#define BRA_MAX 128
+/* the max counts of dirty blocks merged into one write */
+#define BWRITE_IOV_MAX 128
+/* dirty buffers are synced at least once in BSYNC_INTERVAL seconds */
+#define BSYNC_INTERVAL 5
+
+/*
+ * A lock that may be held for a long time (e.g. during disk io), the threads
+ * waiting for it sleep.
+ */
+struct sleeplock {
+  pthread_mutex_t lk;
+  pthread_cond_t cv;
+  int locked;
+  pthread_t owner;
+};
+
 struct buf {
   int valid;   // has data been read from disk?
   int dirty;
   int disk;    // does disk "own" buf?
   uint32_t dev;
-  /* sector number of disk */
+  /* block number of disk, in the block size of the device (sector by default) */
   uint32_t blockno;
-  // struct sleeplock lock;
-  // uint refcnt;
-  // struct buf *prev; // LRU cache list
-  // struct buf *next;
-  uint8_t data[SECTOR_SIZE];
-  // void *data;
-  // todo:
+  struct sleeplock lock;
+  uint32_t refcnt;
+  struct buf *prev; // LRU cache list
+  struct buf *next;
+  struct buf *hnext; // hash chain of (dev, blockno)
+  uint32_t size; // bytes allocated for data
+  uint8_t *data;
 };
 
 
@@ -59,9 +82,160 @@ struct linux_dirent64 {
 
 typedef struct buf buf_t;
 
+/* the max counts of devices opened at the same time */
+#define NDEV 4
+
+/* flags of bdev_open */
+#define BDEV_RDONLY 0x1
+/* map the whole image read only, implies BDEV_RDONLY */
+#define BDEV_MMAP   0x2
+/* bypass the page cache of the host with O_DIRECT */
+#define BDEV_DIRECT 0x4
+
+/* the alignment of the buffers from bpool_alloc, BDEV_DIRECT is dropped on a
+  device which needs more */
+#define BPOOL_ALIGN 4096
+/* the max counts of free buffers kept by the pool */
+#define BPOOL_MAX   64
+
+/*
+ * A device (image file or block device) opened once at mount,
+ * bread and bwrite use positional io on its fd.
+ */
+struct bdev {
+  int fd;
+  int flags;
+  const char *path;
+  /* the unit of blockno in bread and breadv, SECTOR_SIZE by default */
+  uint32_t bsize;
+  /* the image mapped by BDEV_MMAP and its size */
+  uint8_t *map;
+  uint64_t size;
+  /* the alignment of offset, length and memory of io, the logical sector size for BDEV_DIRECT */
+  uint32_t align;
+  /* held for writing by the read-modify-write of the sectors around an
+    unaligned BDEV_DIRECT write, for reading by the other writes */
+  pthread_rwlock_t rmw_lock;
+  /* the counts of dirty buffers and the time of the last bsync */
+  int ndirty;
+  long last_sync;
+};
+
 
+void initsleeplock(struct sleeplock *lk);
+void acquiresleep(struct sleeplock *lk);
+int tryacquiresleep(struct sleeplock *lk);
+void releasesleep(struct sleeplock *lk);
+int holdingsleep(struct sleeplock *lk);
+int bdev_open(uint32_t dev, const char *path, int flags);
+void bdev_close(uint32_t dev);
+struct bdev *bdev_get(uint32_t dev);
+void bdev_set_bsize(uint32_t dev, uint32_t bsize);
+void *bmap(uint32_t dev, uint64_t blockno, uint32_t cnt);
+ssize_t bdev_preadv(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off);
+ssize_t bdev_pwritev(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off);
+int bdev_can_async(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off);
+void *bpool_alloc(uint32_t size);
+void bpool_free(void *p, uint32_t size);
+void binit(int nbuf);
 buf_t* bread(uint32_t dev, uint32_t blockno);
+buf_t* bgetblk(uint32_t dev, uint32_t blockno);
 void bwrite(struct buf *b);
+void brelse(struct buf *b);
+void bsync(uint32_t dev);
+void breadv(uint32_t dev, uint64_t blockno, const struct iovec *iov, int iovcnt);
+void bwritev(uint32_t dev, uint64_t blockno, const struct iovec *iov, int iovcnt);
+void bcoherent(uint32_t dev, uint64_t blockno, void *data, uint32_t cnt, int write);
+void breadahead(uint32_t dev, uint64_t blockno, uint32_t cnt);
+
+/* the max counts of requests in one struct bio_batch */
+#define BIO_BATCH_MAX 32
+
+/*
+ * An asynchronous read of cnt blocks into data (or scattered into iovp),
+ * queued in a struct bio_batch.
+ */
+struct bio_req {
+  uint32_t dev;
+  uint64_t blockno;
+  uint32_t cnt;
+  void *data;
+  struct iovec iov;
+  const struct iovec *iovp; // &iov, or the iovecs given to bio_batch_addv
+  int iovcnt;
+  int res;  // bytes read, or negative errno
+};
+
+/*
+ * Block reads queued by bio_batch_add are submitted together by bio_batch_submit,
+ * and their data is ready after bio_batch_wait.
+ */
+struct bio_batch {
+  int nreq;
+  int nsubmitted;
+  struct bio_req req[BIO_BATCH_MAX];
+};
+
+/*
+ * The backend of struct bio_batch: io_uring if the kernel supports it,
+ * otherwise synchronous preadv.
+ */
+struct bio_engine {
+  const char *name;
+  int (*init)(void);
+  void (*submit)(struct bio_batch *bb);
+  void (*wait)(struct bio_batch *bb);
+};
+
+/**
+ * A CRC32C kernel of crc32.c, usable is 0 if it runs on every cpu.
+ * batch is 0 if the buffers of a batch are done one by one.
+ */
+struct crc32c_impl {
+  const char *name;
+  uint32_t (*crc)(uint32_t crc, const unsigned char *p, unsigned int length);
+  void (*batch)(uint32_t *crc, const void *const *buf, const unsigned int *len, int n);
+  int (*usable)(void);
+};
+
+extern const struct crc32c_impl crc32c_impls[];
+extern const int crc32c_nimpls;
+
+/**
+ * A free bit search kernel of bitmap.c, usable is 0 if it runs on every cpu.
+ * find returns the first bit equal to bit in [start, nbits) of map, or -1.
+ */
+struct bitmap_impl {
+  const char *name;
+  int (*find)(const uint8_t *map, int start, int nbits, int bit);
+  int (*usable)(void);
+};
+
+extern const struct bitmap_impl bitmap_impls[];
+extern const int bitmap_nimpls;
+
+void bio_batch_init(struct bio_batch *bb);
+void bio_batch_add(struct bio_batch *bb, uint32_t dev, uint64_t blockno, uint32_t cnt, void *data);
+void bio_batch_addv(struct bio_batch *bb, uint32_t dev, uint64_t blockno, const struct iovec *iov, int iovcnt);
+void bio_batch_submit(struct bio_batch *bb);
+void bio_batch_wait(struct bio_batch *bb);
+const char *bio_engine_name(void);
+int bitmap_find_zero(const void *map, int start, int nbits);
+int bitmap_find_one(const void *map, int start, int nbits);
+int bitmap_find_zero_run(const void *map, int start, int nbits, int len);
+void bitmap_set(void *map, int start, int len);
+void bitmap_clear(void *map, int start, int len);
+const char *bitmap_impl_name(void);
+uint32_t crc32c(uint32_t crc, const void *data, unsigned int length);
+uint32_t singletable_crc32c(uint32_t crc, const unsigned char *buf, unsigned int size);
+uint32_t crc32c_bytewise(uint32_t crc, const uint8_t *data, unsigned int length);
+uint32_t calculate_crc32c(uint32_t crc32c, const unsigned char *buffer, unsigned int length);
+const char *crc32c_impl_name(void);
+uint16_t crc16(uint16_t crc, const void *data, unsigned int length);
+uint32_t crc32c_shift(uint32_t crc, uint64_t len);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+uint32_t crc32c_patch(uint32_t crc, const void *old, const void *new, unsigned int len, uint64_t tail);
+void crc32c_batch(uint32_t *crc, const void *const *buf, const unsigned int *len, int n);
 void panic(char *s);
 void TODO();
 
@@ -0,0 +1,367 @@
+/**
+ * @file bio.c
+ * @author Yangyang Zhu (1929772352@qq.com)
+ * @version 0.1
+ * @date 2023-03-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Batched asynchronous block reads. The reads queued in a struct bio_batch are
+ * submitted with one io_uring_enter and their completions are reaped together.
+ * If io_uring is not supported by the kernel (or BIO_ENGINE=sync is set in the
+ * environment), the requests are served by synchronous preadv.
+ * liburing is not required, the rings are set up with the raw system calls.
+ * Every thread has its own ring, which is set up at its first submission.
+ */
+
+#include "tatakos.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* the counts of entries of the submission queue */
+#define URING_ENTRIES 64
+
+static __thread struct {
+  int ready;  /* 1: set up, -1: failed */
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned inflight;
+} uring;
+
+static struct bio_engine *engine;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static void sync_submit(struct bio_batch *bb);
+
+static int uring_init(void)
+{
+  struct io_uring_params p;
+  void *sq, *cq;
+  size_t sq_size, cq_size;
+
+  memset(&p, 0, sizeof(p));
+  uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if(uring.fd < 0)
+    return -1;
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  /* since 5.4 both rings live in one mapping */
+  if(p.features & IORING_FEAT_SINGLE_MMAP){
+    if(cq_size > sq_size)
+      sq_size = cq_size;
+    cq_size = sq_size;
+  }
+
+  sq = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            uring.fd, IORING_OFF_SQ_RING);
+  if(sq == MAP_FAILED)
+    goto bad;
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else {
+    cq = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              uring.fd, IORING_OFF_CQ_RING);
+    if(cq == MAP_FAILED)
+      goto bad;
+  }
+  uring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if(uring.sqes == MAP_FAILED)
+    goto bad;
+
+  uring.sq_head = sq + p.sq_off.head;
+  uring.sq_tail = sq + p.sq_off.tail;
+  uring.sq_mask = sq + p.sq_off.ring_mask;
+  uring.sq_array = sq + p.sq_off.array;
+  uring.cq_head = cq + p.cq_off.head;
+  uring.cq_tail = cq + p.cq_off.tail;
+  uring.cq_mask = cq + p.cq_off.ring_mask;
+  uring.cqes = cq + p.cq_off.cqes;
+  uring.ready = 1;
+  return 0;
+
+bad:
+  close(uring.fd);
+  uring.ready = -1;
+  return -1;
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+  int n;
+
+  do {
+    n = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete,
+                min_complete ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+  } while(n < 0 && errno == EINTR);
+  if(n < 0)
+    panic("io_uring_enter failed");
+  return n;
+}
+
+/**
+ * Reap the completions which are already posted, return the counts of them.
+ */
+static int uring_reap(void)
+{
+  unsigned head = *uring.cq_head;
+  struct io_uring_cqe *cqe;
+  struct bio_req *r;
+  int n = 0;
+
+  while(head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)){
+    cqe = &uring.cqes[head & *uring.cq_mask];
+    r = (struct bio_req *)(uintptr_t)cqe->user_data;
+    r->res = cqe->res;
+    head++;
+    n++;
+  }
+  __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+  uring.inflight -= n;
+  return n;
+}
+
+static void uring_submit(struct bio_batch *bb)
+{
+  unsigned tail, queued = 0;
+  struct io_uring_sqe *sqe;
+  struct bio_req *r;
+
+  /* the ring of this thread could not be set up */
+  if((uring.ready == 0 && uring_init() < 0) || uring.ready < 0){
+    sync_submit(bb);
+    return;
+  }
+  while(bb->nsubmitted < bb->nreq){
+    /* the submission queue is full, wait for some of the requests */
+    if(uring.inflight + queued == URING_ENTRIES){
+      uring_enter(queued, 1);
+      uring.inflight += queued;
+      queued = 0;
+      uring_reap();
+      continue;
+    }
+    r = &bb->req[bb->nsubmitted++];
+    /* unaligned O_DIRECT io needs a bounce buffer, do it synchronously */
+    if(!bdev_can_async(bdev_get(r->dev), r->iovp, r->iovcnt, r->blockno * bdev_get(r->dev)->bsize)){
+      r->res = bdev_preadv(bdev_get(r->dev), r->iovp, r->iovcnt, r->blockno * bdev_get(r->dev)->bsize);
+      if(r->res < 0)
+        r->res = -errno;
+      continue;
+    }
+    tail = *uring.sq_tail;
+    sqe = &uring.sqes[tail & *uring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = bdev_get(r->dev)->fd;
+    sqe->off = r->blockno * bdev_get(r->dev)->bsize;
+    sqe->addr = (uintptr_t)r->iovp;
+    sqe->len = r->iovcnt;
+    sqe->user_data = (uintptr_t)r;
+    uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+  }
+  if(queued){
+    uring_enter(queued, 0);
+    uring.inflight += queued;
+  }
+}
+
+static void uring_wait(struct bio_batch *bb)
+{
+  int i, done;
+
+  /* the ring of this thread is not set up (nothing submitted) or failed */
+  if(uring.ready <= 0)
+    return;
+  for(;;){
+    uring_reap();
+    done = 1;
+    for(i = 0; i < bb->nreq; i++)
+      if(bb->req[i].res == -EINPROGRESS)
+        done = 0;
+    if(done)
+      break;
+    uring_enter(0, 1);
+  }
+}
+
+static int sync_init(void)
+{
+  return 0;
+}
+
+static void sync_submit(struct bio_batch *bb)
+{
+  struct bio_req *r;
+
+  for(; bb->nsubmitted < bb->nreq; bb->nsubmitted++){
+    r = &bb->req[bb->nsubmitted];
+    r->res = bdev_preadv(bdev_get(r->dev), r->iovp, r->iovcnt, r->blockno * bdev_get(r->dev)->bsize);
+    if(r->res < 0)
+      r->res = -errno;
+  }
+}
+
+static void sync_wait(struct bio_batch *bb)
+{
+}
+
+static struct bio_engine uring_engine = {
+  .name = "io_uring",
+  .init = uring_init,
+  .submit = uring_submit,
+  .wait = uring_wait,
+};
+
+static struct bio_engine sync_engine = {
+  .name = "sync",
+  .init = sync_init,
+  .submit = sync_submit,
+  .wait = sync_wait,
+};
+
+static void bio_engine_choose(void)
+{
+  const char *env;
+
+  env = getenv("BIO_ENGINE");
+  if((env == 0 || strcmp(env, "sync") != 0) && uring_engine.init() == 0)
+    engine = &uring_engine;
+  else {
+    sync_engine.init();
+    engine = &sync_engine;
+  }
+}
+
+/**
+ * Choose the engine at the first use.
+ */
+static struct bio_engine *bio_engine(void)
+{
+  pthread_once(&engine_once, bio_engine_choose);
+  return engine;
+}
+
+const char *bio_engine_name(void)
+{
+  return bio_engine()->name;
+}
+
+void bio_batch_init(struct bio_batch *bb)
+{
+  bb->nreq = 0;
+  bb->nsubmitted = 0;
+}
+
+/**
+ * Queue a read of cnt blocks begin with blockno of dev into data.
+ * The blocks of a mapped device are copied at once.
+ */
+void bio_batch_add(struct bio_batch *bb, uint32_t dev, uint64_t blockno, uint32_t cnt, void *data)
+{
+  struct bdev *bd = bdev_get(dev);
+  struct bio_req *r;
+
+  assert(bb->nreq < BIO_BATCH_MAX);
+  if(bd->map){
+    memcpy(data, bmap(dev, blockno, cnt), cnt * bd->bsize);
+    return;
+  }
+
+  r = &bb->req[bb->nreq++];
+  r->dev = dev;
+  r->blockno = blockno;
+  r->cnt = cnt;
+  r->data = data;
+  r->iov.iov_base = data;
+  r->iov.iov_len = cnt * bd->bsize;
+  r->iovp = &r->iov;
+  r->iovcnt = 1;
+  r->res = -EINPROGRESS;
+}
+
+/**
+ * Queue a read of the blocks begin with blockno of dev scattered into iov,
+ * the length of every iovec must be multiple of the block size of dev.
+ * The iovecs must be kept until bio_batch_wait.
+ */
+void bio_batch_addv(struct bio_batch *bb, uint32_t dev, uint64_t blockno, const struct iovec *iov, int iovcnt)
+{
+  struct bdev *bd = bdev_get(dev);
+  struct bio_req *r;
+  uint64_t len = 0;
+  int i;
+
+  assert(bb->nreq < BIO_BATCH_MAX);
+  if(bd->map){
+    for(i = 0; i < iovcnt; i++){
+      memcpy(iov[i].iov_base, bmap(dev, blockno, iov[i].iov_len / bd->bsize), iov[i].iov_len);
+      blockno += iov[i].iov_len / bd->bsize;
+    }
+    return;
+  }
+  for(i = 0; i < iovcnt; i++){
+    assert(iov[i].iov_len % bd->bsize == 0);
+    len += iov[i].iov_len;
+  }
+
+  r = &bb->req[bb->nreq++];
+  r->dev = dev;
+  r->blockno = blockno;
+  r->cnt = len / bd->bsize;
+  r->data = 0;
+  r->iov.iov_base = 0;
+  r->iov.iov_len = len;
+  r->iovp = iov;
+  r->iovcnt = iovcnt;
+  r->res = -EINPROGRESS;
+}
+
+/**
+ * Submit all the queued requests, it does not wait for them.
+ */
+void bio_batch_submit(struct bio_batch *bb)
+{
+  if(bb->nsubmitted < bb->nreq)
+    bio_engine()->submit(bb);
+}
+
+/**
+ * Submit what is not submitted yet and wait for all the requests of the batch.
+ * The data read is made coherent with the buffer cache, then the batch is empty.
+ */
+void bio_batch_wait(struct bio_batch *bb)
+{
+  struct bio_req *r;
+  uint64_t blockno;
+  int i, j;
+
+  bio_batch_submit(bb);
+  bio_engine()->wait(bb);
+  for(i = 0; i < bb->nreq; i++){
+    r = &bb->req[i];
+    /* iov.iov_len holds the total length of the request */
+    if(r->res != r->iov.iov_len)
+      panic("bio: short read");
+    blockno = r->blockno;
+    for(j = 0; j < r->iovcnt; j++){
+      bcoherent(r->dev, blockno, r->iovp[j].iov_base, r->iovp[j].iov_len / bdev_get(r->dev)->bsize, 0);
+      blockno += r->iovp[j].iov_len / bdev_get(r->dev)->bsize;
+    }
+  }
+  bio_batch_init(bb);
+}
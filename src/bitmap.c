@@ -0,0 +1,240 @@
+/**
+ * @file bitmap.c
+ * @author Yangyang Zhu (1929772352@qq.com)
+ * @version 0.1
+ * @date 2023-03-25
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Searching the block and inode bitmaps. Bit i of a bitmap is bit i%8 of
+ * byte i/8 (the ext4 on-disk order), which is bit i%64 of the i/64-th
+ * little endian 64-bit word, so the bitmaps are scanned a word at a time
+ * with ctz. On x86 the runs of full (or empty) bytes are skipped 16 (SSE2)
+ * or 32 (AVX2) bytes at a time before the word scan. The implementation is
+ * chosen with cpuid at the first use, BITMAP_IMPL=scalar|word|sse2|avx2 in
+ * the environment overrides it (if the cpu has it).
+ */
+
+#include "tatakos.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86
+#endif
+
+/**
+ * Load the 64 bits begin with bit i (a multiple of 64), the bytes at and
+ * beyond nbits are not read.
+ */
+static inline uint64_t bitmap_load64(const uint8_t *map, int i, int nbits)
+{
+  uint64_t w = 0;
+  int nbytes = (nbits + 7) / 8 - i / 8;
+
+  if(nbytes >= 8)
+    memcpy(&w, map + i / 8, 8);
+  else
+    memcpy(&w, map + i / 8, nbytes);
+  return w;
+}
+
+/**
+ * The generic fallback, one bit at a time, but the bytes without the bit
+ * wanted are skipped.
+ */
+static int bitmap_find_scalar(const uint8_t *map, int start, int nbits, int bit)
+{
+  uint8_t skip = bit ? 0 : 0xff;
+  int i;
+
+  for(i = start; i < nbits; i++){
+    if((i & 7) == 0 && map[i >> 3] == skip && i + 8 <= nbits){
+      i += 7;
+      continue;
+    }
+    if(((map[i >> 3] >> (i & 7)) & 1) == bit)
+      return i;
+  }
+  return -1;
+}
+
+static int bitmap_find_word(const uint8_t *map, int start, int nbits, int bit)
+{
+  uint64_t flip = bit ? 0 : ~0ULL, w;
+  int i = start & ~63;
+
+  if(start >= nbits)
+    return -1;
+  w = (bitmap_load64(map, i, nbits) ^ flip) & (~0ULL << (start & 63));
+  for(;;){
+    if(w){
+      i += __builtin_ctzll(w);
+      return i < nbits ? i : -1;
+    }
+    i += 64;
+    if(i >= nbits)
+      return -1;
+    w = bitmap_load64(map, i, nbits) ^ flip;
+  }
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("sse2")))
+static int bitmap_find_sse2(const uint8_t *map, int start, int nbits, int bit)
+{
+  __m128i skip = _mm_set1_epi8(bit ? 0 : 0xff);
+  int i = (start + 127) & ~127, r;
+
+  /* the bits before the first 128-bit chunk */
+  if(i > nbits)
+    i = nbits;
+  if((r = bitmap_find_word(map, start, i, bit)) >= 0)
+    return r;
+  for(; i + 128 <= nbits; i += 128){
+    __m128i v = _mm_loadu_si128((const __m128i *)(map + i / 8));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, skip)) != 0xffff)
+      break;
+  }
+  return bitmap_find_word(map, i, nbits, bit);
+}
+
+__attribute__((target("avx2")))
+static int bitmap_find_avx2(const uint8_t *map, int start, int nbits, int bit)
+{
+  __m256i skip = _mm256_set1_epi8(bit ? 0 : 0xff);
+  int i = (start + 255) & ~255, r;
+
+  /* the bits before the first 256-bit chunk */
+  if(i > nbits)
+    i = nbits;
+  if((r = bitmap_find_word(map, start, i, bit)) >= 0)
+    return r;
+  for(; i + 256 <= nbits; i += 256){
+    __m256i v = _mm256_loadu_si256((const __m256i *)(map + i / 8));
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, skip)) != -1)
+      break;
+  }
+  return bitmap_find_word(map, i, nbits, bit);
+}
+#endif
+
+#ifdef BITMAP_X86
+static int bitmap_has_sse2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+static int bitmap_has_avx2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* in the order of preference, the last usable one is chosen */
+const struct bitmap_impl bitmap_impls[] = {
+  { "scalar", bitmap_find_scalar, 0 },
+  { "word", bitmap_find_word, 0 },
+#ifdef BITMAP_X86
+  { "sse2", bitmap_find_sse2, bitmap_has_sse2 },
+  { "avx2", bitmap_find_avx2, bitmap_has_avx2 },
+#endif
+};
+const int bitmap_nimpls = sizeof(bitmap_impls) / sizeof(bitmap_impls[0]);
+
+static int bitmap_impl = -1;
+static pthread_once_t bitmap_once = PTHREAD_ONCE_INIT;
+
+static void bitmap_choose(void)
+{
+  const char *env = getenv("BITMAP_IMPL");
+  int i;
+
+  for(i = 0; i < bitmap_nimpls; i++){
+    if(bitmap_impls[i].usable && !bitmap_impls[i].usable())
+      continue;
+    bitmap_impl = i;
+    if(env && strcmp(env, bitmap_impls[i].name) == 0)
+      return;
+  }
+}
+
+static inline int bitmap_find(const void *map, int start, int nbits, int bit)
+{
+  pthread_once(&bitmap_once, bitmap_choose);
+  if(start < 0)
+    start = 0;
+  return bitmap_impls[bitmap_impl].find(map, start, nbits, bit);
+}
+
+const char *bitmap_impl_name(void)
+{
+  pthread_once(&bitmap_once, bitmap_choose);
+  return bitmap_impls[bitmap_impl].name;
+}
+
+/**
+ * Return the first zero bit in [start, nbits) of map, or -1.
+ */
+int bitmap_find_zero(const void *map, int start, int nbits)
+{
+  return bitmap_find(map, start, nbits, 0);
+}
+
+/**
+ * Return the first set bit in [start, nbits) of map, or -1.
+ */
+int bitmap_find_one(const void *map, int start, int nbits)
+{
+  return bitmap_find(map, start, nbits, 1);
+}
+
+/**
+ * Return the first bit of the first run of len zero bits in [start, nbits)
+ * of map, or -1.
+ */
+int bitmap_find_zero_run(const void *map, int start, int nbits, int len)
+{
+  int i = start, j;
+
+  for(;;){
+    if((i = bitmap_find(map, i, nbits, 0)) < 0 || i + len > nbits)
+      return -1;
+    /* the run is broken by the first set bit in it */
+    if((j = bitmap_find(map, i, i + len, 1)) < 0)
+      return i;
+    i = j;
+  }
+}
+
+/**
+ * Set (bit = 1) or clear (bit = 0) the bits [start, start + len) of map,
+ * the whole bytes in the range are written with one memset.
+ */
+static void bitmap_fill(void *map, int start, int len, int bit)
+{
+  uint8_t *p = map;
+  int end = start + len, i = start;
+
+  for(; i < end && (i & 7); i++)
+    p[i >> 3] = bit ? p[i >> 3] | 1 << (i & 7) : p[i >> 3] & ~(1 << (i & 7));
+  if(end - i >= 8){
+    memset(p + (i >> 3), bit ? 0xff : 0, (end - i) >> 3);
+    i += (end - i) & ~7;
+  }
+  for(; i < end; i++)
+    p[i >> 3] = bit ? p[i >> 3] | 1 << (i & 7) : p[i >> 3] & ~(1 << (i & 7));
+}
+
+void bitmap_set(void *map, int start, int len)
+{
+  bitmap_fill(map, start, len, 1);
+}
+
+void bitmap_clear(void *map, int start, int len)
+{
+  bitmap_fill(map, start, len, 0);
+}
@@ -48,7 +48,14 @@
 // #include <sys/param.h>
 // #include <sys/systm.h>
 
-#include <stdint.h>
+#include "tatakos.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
 
 const uint32_t crc32_tab[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -205,7 +212,7 @@ static const uint32_t crc32Table[256] = {
 
 uint32_t
 // singletable_crc32c(uint32_t crc, const void *buf, size_t size)
-singletable_crc32c(uint32_t crc, const void *buf, uint32_t size)
+singletable_crc32c(uint32_t crc, const unsigned char *buf, unsigned int size)
 {
 	const uint8_t *p = buf;
 
@@ -297,7 +304,7 @@ static const uint32_t crc32c_table[256] = {
  * crc using table.
  */
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+uint32_t crc32c_bytewise(uint32_t crc, const uint8_t *data, unsigned int length)
 {
 	while (length--)
 		crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
@@ -847,4 +854,354 @@ calculate_crc32c(uint32_t crc32c,
 	}
 }
 
-// https://web.mit.edu/freebsd/head/sys/libkern/crc32.c
\ No newline at end of file
+// https://web.mit.edu/freebsd/head/sys/libkern/crc32.c
+#ifdef CRC32C_X86
+/*
+ * CRC-32C with the SSE4.2 crc32 instruction, which computes the same
+ * reflected crc as the tables above. The bytes before the first 8-byte
+ * boundary and after the last one are done one at a time, the rest a
+ * word at a time.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, unsigned int length)
+{
+#ifdef __x86_64__
+	uint64_t crc64;
+
+	for (; length && ((uintptr_t) p & 7); length--)
+		crc = _mm_crc32_u8(crc, *p++);
+	crc64 = crc;
+	for (; length >= 8; length -= 8, p += 8)
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *) p);
+	crc = (uint32_t) crc64;
+#else
+	for (; length && ((uintptr_t) p & 3); length--)
+		crc = _mm_crc32_u8(crc, *p++);
+	for (; length >= 4; length -= 4, p += 4)
+		crc = _mm_crc32_u32(crc, *(const uint32_t *) p);
+#endif
+	while (length--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+#if defined(CRC32C_X86) && defined(__x86_64__)
+static void crc32c_batch_sse42(uint32_t *crc, const void *const *buf,
+    const unsigned int *len, int n);
+#else
+#define crc32c_batch_sse42 0
+#endif
+
+#ifdef CRC32C_X86
+static int
+crc32c_has_sse42(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+/*
+ * The kernels, slowest first. The implementation behind crc32c() is the
+ * last one usable on this cpu, it is chosen at the first use,
+ * CRC32C_IMPL=single|bytewise|sb8|sse42 in the environment overrides it
+ * (test/crc_bench.c measures them).
+ */
+const struct crc32c_impl crc32c_impls[] = {
+	{ "single", singletable_crc32c, 0, 0 },
+	{ "bytewise", crc32c_bytewise, 0, 0 },
+	{ "sb8", calculate_crc32c, 0, 0 },
+#ifdef CRC32C_X86
+	{ "sse42", crc32c_sse42, crc32c_batch_sse42, crc32c_has_sse42 },
+#endif
+};
+const int crc32c_nimpls = sizeof(crc32c_impls) / sizeof(crc32c_impls[0]);
+
+static int crc32c_impl = -1;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32c_choose(void)
+{
+	const char *env = getenv("CRC32C_IMPL");
+	int i;
+
+	for (i = 0; i < crc32c_nimpls; i++) {
+		if (crc32c_impls[i].usable && !crc32c_impls[i].usable())
+			continue;
+		crc32c_impl = i;
+		if (env && strcmp(env, crc32c_impls[i].name) == 0)
+			return;
+	}
+}
+
+/*
+ * Update the crc (not inverted) with length bytes of data, every checksum
+ * of the file system is computed with it.
+ */
+uint32_t
+crc32c(uint32_t crc, const void *data, unsigned int length)
+{
+	pthread_once(&crc32c_once, crc32c_choose);
+	return crc32c_impls[crc32c_impl].crc(crc, data, length);
+}
+
+const char *
+crc32c_impl_name(void)
+{
+	pthread_once(&crc32c_once, crc32c_choose);
+	return crc32c_impls[crc32c_impl].name;
+}
+
+/*
+ * CRC-16 (polynomial 0x8005, reflected) one bit at a time, it checksums the
+ * group descriptors of the file systems with gdt_csum but not metadata_csum.
+ */
+uint16_t
+crc16(uint16_t crc, const void *data, unsigned int length)
+{
+	const unsigned char *p = data;
+	int i;
+
+	while (length--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xA001 : 0);
+	}
+	return crc;
+}
+
+/*
+ * CRC-32C is linear: the crc of a message is the xor of the crcs (from 0)
+ * of its parts, each multiplied by x^(8n) modulo the polynomial, where n is
+ * the counts of bytes after the part. So a crc can be extended by n zero
+ * bytes, two crcs can be combined, and the crc of a block can be patched
+ * after a change of some of its bytes, with O(log n) multiplications
+ * instead of hashing the bytes again. The crcs are the raw registers as
+ * crc32c() returns them, not inverted.
+ */
+#define CRC32C_POLY 0x82f63b78
+
+/* x^(2^k) modulo the polynomial, in the reflected order */
+static uint32_t crc32c_x2n[32];
+static pthread_once_t crc32c_x2n_once = PTHREAD_ONCE_INIT;
+
+/*
+ * a * b modulo the polynomial, in the reflected order (x^0 is bit 31).
+ */
+static uint32_t
+crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t) 1 << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+static void
+crc32c_x2n_init(void)
+{
+	uint32_t p = (uint32_t) 1 << 30;	/* x^1 */
+	int k;
+
+	for (k = 0; k < 32; k++) {
+		crc32c_x2n[k] = p;
+		p = crc32c_multmodp(p, p);
+	}
+}
+
+/*
+ * x^(n * 2^k) modulo the polynomial.
+ */
+static uint32_t
+crc32c_x2nmodp(uint64_t n, int k)
+{
+	uint32_t p = (uint32_t) 1 << 31;	/* x^0 */
+
+	pthread_once(&crc32c_x2n_once, crc32c_x2n_init);
+	for (; n; n >>= 1, k++)
+		if (n & 1)
+			p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+	return p;
+}
+
+/*
+ * The crc of len zero bytes more after crc, crc32c(crc, zeros, len).
+ */
+uint32_t
+crc32c_shift(uint32_t crc, uint64_t len)
+{
+	return crc32c_multmodp(crc32c_x2nmodp(len, 3), crc);
+}
+
+/*
+ * The crc of a message A followed by B of len2 bytes, where crc1 is
+ * crc32c(seed, A) and crc2 is crc32c(0, B).
+ */
+uint32_t
+crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	return crc32c_shift(crc1, len2) ^ crc2;
+}
+
+/*
+ * Patch crc, the crc of a message, after len bytes of it are changed from
+ * old to new, tail is the counts of bytes after them. Only the changed
+ * bytes are hashed.
+ */
+uint32_t
+crc32c_patch(uint32_t crc, const void *old, const void *new, unsigned int len, uint64_t tail)
+{
+	return crc ^ crc32c_shift(crc32c(0, old, len) ^ crc32c(0, new, len), tail);
+}
+
+#if defined(CRC32C_X86) && defined(__x86_64__)
+/*
+ * The crc32 instruction has a latency of 3 cycles but a throughput of one
+ * per cycle, so one stream keeps it busy a third of the time. The batch
+ * kernel runs three independent streams interleaved: three short buffers
+ * at a time, or the three thirds of a long one, whose crcs are joined with
+ * one carry-less multiplication each (pclmulqdq) instead of crc32c_shift.
+ */
+#define CRC32C_FOLD_MIN 1024
+
+static int crc32c_pclmul = -1;
+
+static inline uint64_t
+crc32c_load64(const unsigned char *p)
+{
+	uint64_t w;
+
+	memcpy(&w, p, 8);
+	return w;
+}
+
+/*
+ * Advance the three crcs over len bytes (a multiple of 8) of their streams.
+ */
+__attribute__((target("sse4.2")))
+static void
+crc32c_sse42_x3(uint32_t *crc, const unsigned char **p, unsigned int len)
+{
+	uint64_t c0 = crc[0], c1 = crc[1], c2 = crc[2];
+	const unsigned char *p0 = p[0], *p1 = p[1], *p2 = p[2];
+	unsigned int i;
+
+	for (i = 0; i < len; i += 8) {
+		c0 = _mm_crc32_u64(c0, crc32c_load64(p0 + i));
+		c1 = _mm_crc32_u64(c1, crc32c_load64(p1 + i));
+		c2 = _mm_crc32_u64(c2, crc32c_load64(p2 + i));
+	}
+	crc[0] = c0;
+	crc[1] = c1;
+	crc[2] = c2;
+	p[0] += len;
+	p[1] += len;
+	p[2] += len;
+}
+
+/*
+ * crc32c_shift(crc, len) with a constant k = x^(8 len - 33): the product
+ * of the carry-less multiplication is reduced by crc32 of it, which also
+ * multiplies it by x^33.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t
+crc32c_shift_clmul(uint32_t crc, uint32_t k)
+{
+	__m128i a = _mm_cvtsi32_si128(crc), b = _mm_cvtsi32_si128(k);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_clmulepi64_si128(a, b, 0)));
+}
+
+/*
+ * The crc of a long buffer by its three thirds at once. The constant of
+ * the last length is kept, the buffers of a scan have the same length.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t
+crc32c_sse42_fold(uint32_t crc, const unsigned char *p, unsigned int len)
+{
+	static __thread unsigned int k_len;
+	static __thread uint32_t k;
+	unsigned int third = len / 24 * 8;
+	const unsigned char *ps[3] = { p, p + third, p + 2 * third };
+	uint32_t crcs[3] = { crc, 0, 0 };
+
+	if (k_len != third) {
+		k = crc32c_x2nmodp(8 * (uint64_t) third - 33, 0);
+		k_len = third;
+	}
+	crc32c_sse42_x3(crcs, ps, third);
+	crc = crc32c_shift_clmul(crcs[0], k) ^ crcs[1];
+	crc = crc32c_shift_clmul(crc, k) ^ crcs[2];
+	return crc32c_sse42(crc, ps[2], len - 3 * third);
+}
+
+static void
+crc32c_batch_sse42(uint32_t *crc, const void *const *buf,
+    const unsigned int *len, int n)
+{
+	const unsigned char *ps[3];
+	uint32_t crcs[3];
+	unsigned int common;
+	int i, j, idx[3], m = 0;
+
+	if (crc32c_pclmul < 0) {
+		__builtin_cpu_init();
+		crc32c_pclmul = __builtin_cpu_supports("pclmul") != 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (len[i] >= CRC32C_FOLD_MIN && crc32c_pclmul) {
+			crc[i] = crc32c_sse42_fold(crc[i], buf[i], len[i]);
+			continue;
+		}
+		idx[m++] = i;
+		if (m < 3)
+			continue;
+		/* the shortest length of the three is done together */
+		common = len[idx[0]];
+		for (j = 0; j < 3; j++) {
+			if (len[idx[j]] < common)
+				common = len[idx[j]];
+			ps[j] = buf[idx[j]];
+			crcs[j] = crc[idx[j]];
+		}
+		common &= ~7;
+		crc32c_sse42_x3(crcs, ps, common);
+		for (j = 0; j < 3; j++)
+			crc[idx[j]] = crc32c_sse42(crcs[j], ps[j], len[idx[j]] - common);
+		m = 0;
+	}
+	for (j = 0; j < m; j++)
+		crc[idx[j]] = crc32c_sse42(crc[idx[j]], buf[idx[j]], len[idx[j]]);
+}
+#endif
+
+/*
+ * crc[i] = crc32c(crc[i], buf[i], len[i]) for the n independent buffers,
+ * with the batch kernel of the implementation if it has one.
+ */
+void
+crc32c_batch(uint32_t *crc, const void *const *buf, const unsigned int *len, int n)
+{
+	int i;
+
+	pthread_once(&crc32c_once, crc32c_choose);
+	if (crc32c_impls[crc32c_impl].batch) {
+		crc32c_impls[crc32c_impl].batch(crc, buf, len, n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		crc[i] = crc32c_impls[crc32c_impl].crc(crc[i], buf[i], len[i]);
+}
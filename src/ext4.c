@@ -16,147 +16,618 @@
 #include <string.h>
 
 #include <zlib.h>
+#include <time.h>
 
 ext4_super_block_t es;
-/* The descriptors of block group.
-  The number of block groups is the size of the device divided by the size of a block group. */
-ext4_group_desc_t egd[EXT4_MAX_BG_CNT];
+/* The descriptors of block group, bg_cnts of them, allocated at mount.
+  Every descriptor is held in a whole (64 bytes) struct ext4_group_desc and the
+  array is aligned, so one descriptor is one cache line whatever s_desc_size is. */
+ext4_group_desc_t *egd;
 /* The counts of block group */
 int bg_cnts;
+/* The device the file system is mounted on */
+uint32_t ext4_dev;
 
 
-uint8_t ext4_block_buff[EXT4_BLOCK_SIZE];
+/* The block size of the mounted file system, from s_log_block_size */
+uint32_t ext4_block_size;
+uint32_t ext4_block_bits;
+
+/* scratch block of the super block and group descriptors, one per thread */
+static __thread uint8_t ext4_block_buff[EXT4_MAX_BLOCK_SIZE] __attribute__((aligned(BPOOL_ALIGN)));
 ext4_inode_t inode;
 
-extern struct buf buffer;
+/**
+ * Read or write cnt contiguous blocks begin with blockno on disk into (from) buff
+ * with one request, buff should be large enough to hold cnt blocks.
+ * The blocks bypass the buffer cache, it is used for runs of data blocks.
+ */
+void ext4_rw_ondisk_blocks(int blockno, int cnt, void *buff, int rw){
+  struct iovec iov = {
+    .iov_base = buff,
+    .iov_len = cnt * EXT4_BLOCK_SIZE,
+  };
+
+  if(rw == EXT4_READ)
+    breadv(ext4_dev, blockno, &iov, 1);
+  else
+    bwritev(ext4_dev, blockno, &iov, 1);
+}
+
+/**
+ * Like ext4_rw_ondisk_blocks, but the i-th block is read into (written from) buffs[i],
+ * so the caller do not need a contiguous buffer.
+ */
+void ext4_rw_ondisk_blocks_vec(int blockno, int cnt, void **buffs, int rw){
+  struct iovec iov[EXT4_MAX_RW_BLOCKS];
+  int i;
 
-extern uint32_t
-calculate_crc32c(uint32_t crc32c,
-    const unsigned char *buffer,
-    unsigned int length);
+  assert(cnt <= EXT4_MAX_RW_BLOCKS);
+  for(i = 0; i < cnt; i++){
+    iov[i].iov_base = buffs[i];
+    iov[i].iov_len = EXT4_BLOCK_SIZE;
+  }
+
+  if(rw == EXT4_READ)
+    breadv(ext4_dev, blockno, iov, cnt);
+  else
+    bwritev(ext4_dev, blockno, iov, cnt);
+}
+
+/**
+ * Return the address of cnt contiguous blocks begin with blockno. If the image is
+ * mapped (BDEV_MMAP) it points into the mapping and nothing is copied, buff may be 0
+ * in this case. Otherwise the blocks are read into buff and buff is returned.
+ */
+void *ext4_map_blocks(int blockno, int cnt, void *buff){
+  void *p = bmap(ext4_dev, blockno, cnt);
+
+  if(p)
+    return p;
+  assert(buff);
+  ext4_rw_ondisk_blocks(blockno, cnt, buff, EXT4_READ);
+  return buff;
+}
 
 /**
  * read or write the content of block with the number of blockno on disk into buffer.
+ * The block goes through the buffer cache, a write only dirties the cached block,
+ * it reaches the disk at bsync (ext4_umount) or when the buffer is evicted.
  */
 void ext4_rw_ondisk_block(int blockno, void *buff, int rw){
   buf_t *b;
-  int sectorno;
+  void *p;
 
-  for(int i = 0; i < EXT4_BLOCK2SECTOR_CNT; i++){
-    sectorno = EXT4_BLOCKNO2SECTORNO(blockno) + i;
-
-    if(rw == EXT4_READ){
-      b = bread(0, sectorno);
-      memcpy(buff + i*SECTOR_SIZE, b->data, SECTOR_SIZE);
-    } else {
-      b = &buffer;
-      /* conver blockno to sectorno */
-      b->blockno = sectorno;
-      memcpy(b->data, buff + i*SECTOR_SIZE, SECTOR_SIZE);
-      bwrite(b);
-    }
+  /* a mapped image need not to be cached */
+  if(rw == EXT4_READ && (p = bmap(ext4_dev, blockno, 1))){
+    memcpy(buff, p, EXT4_BLOCK_SIZE);
+    return;
   }
 
+  if(rw == EXT4_READ){
+    b = bread(ext4_dev, blockno);
+    memcpy(buff, b->data, EXT4_BLOCK_SIZE);
+  } else {
+    b = bgetblk(ext4_dev, blockno);
+    memcpy(b->data, buff, EXT4_BLOCK_SIZE);
+    bwrite(b);
+  }
+  brelse(b);
 }
 
 /**
  * read super block and block group descriptor
  */
 int ext4_fill_super(){
-  ext4_super_block_t *pes = &es;
-  // ext4_group_desc_t egd[EXT4_MAX_BG_CNT];
-  
-  /* The first 1024 bytes (block 0) is empty , 
-    so we begin form the block 1 . */
-  ext4_rw_ondisk_block(1, ext4_block_buff, EXT4_READ);
-  memcpy(pes, ext4_block_buff, sizeof(ext4_super_block_t));
-  assert(1<<(10 + es.s_log_block_size) == EXT4_BLOCK_SIZE);
+  return ext4_rw_ondisk_super_bgd(EXT4_READ);
+}
+
+/**
+ * The size of a group descriptor on disk, 32 bytes without the 64bit feature.
+ */
+static int ext4_desc_size(){
+  if(!(es.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) || es.s_desc_size == 0)
+    return EXT4_MIN_DESC_SIZE;
+  return es.s_desc_size;
+}
+
+/**
+ * The counts of blocks of the group descriptor table.
+ */
+static int ext4_gdt_blocks(){
+  return (bg_cnts * ext4_desc_size() + EXT4_BLOCK_SIZE - 1) / EXT4_BLOCK_SIZE;
+}
 
-  bg_cnts = pes->s_blocks_count_lo / pes->s_blocks_per_group + 1;
-  assert(bg_cnts < EXT4_MAX_BG_CNT);
-  assert(bg_cnts * sizeof(ext4_group_desc_t) <= sizeof(ext4_block_buff));
+/*
+ * metadata_csum: the checksums of the metadata are crc32c seeded with
+ * crc32c(s_uuid) (or s_checksum_seed), which is computed once at mount.
+ * The blocks owned by an inode (extent blocks, directory leaves) and the
+ * inode itself are seeded with its number and generation on top of it.
+ * A bad checksum found at a read is reported, it is not fatal.
+ */
+static __u32 ext4_csum_seed;
 
-  /* read block group descriptor, padding bytes + one super block bytes */
-  ext4_rw_ondisk_block(2, ext4_block_buff, EXT4_READ);
-  int free_inode_cnt = 0, free_block_cnt = 0;
-  for(int i = 0; i < bg_cnts; i++){
-    memcpy(egd + i, ext4_block_buff + i*sizeof(ext4_group_desc_t), 
-          sizeof(ext4_group_desc_t));
-    free_inode_cnt += egd[i].bg_free_inodes_count_lo;
-    free_block_cnt += egd[i].bg_free_blocks_count_lo;
+/**
+ * Are bg_flags and bg_itable_unused_lo of the group descriptors maintained?
+ */
+static int ext4_has_group_csum(){
+  return es.s_feature_ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+}
+
+static int ext4_has_metadata_csum(){
+  return es.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+}
+
+static void ext4_csum_init(){
+  if(es.s_feature_incompat & EXT4_FEATURE_INCOMPAT_CSUM_SEED)
+    ext4_csum_seed = es.s_checksum_seed;
+  else
+    ext4_csum_seed = crc32c(~0, es.s_uuid, sizeof(es.s_uuid));
+}
+
+static void ext4_csum_bad(const char *what, __u32 n){
+  printf(rd("ext4: bad checksum of %s %u\n"), what, n);
+}
+
+/**
+ * The seed of the checksums of inode ino and its blocks.
+ */
+static __u32 ext4_inode_csum_seed(__u32 ino, __u32 generation){
+  return crc32c(crc32c(ext4_csum_seed, &ino, sizeof(ino)), &generation, sizeof(generation));
+}
+
+/**
+ * Does the raw inode have room for i_checksum_hi?
+ */
+static int ext4_inode_has_csum_hi(ext4_inode_t *raw){
+  return es.s_inode_size > EXT4_GOOD_OLD_INODE_SIZE &&
+         EXT4_GOOD_OLD_INODE_SIZE + raw->i_extra_isize >= __builtin_offsetof(ext4_inode_t, i_ctime_extra);
+}
+
+/**
+ * The checksum of the raw inode ino of s_inode_size bytes, with the checksum
+ * fields taken as zero.
+ */
+static __u32 ext4_inode_csum(__u32 ino, uint8_t *raw){
+  int lo = __builtin_offsetof(ext4_inode_t, osd2.linux2.l_i_checksum_lo);
+  int hi = __builtin_offsetof(ext4_inode_t, i_checksum_hi);
+  __u16 zero = 0;
+  __u32 crc;
+
+  crc = ext4_inode_csum_seed(ino, ((ext4_inode_t *)raw)->i_generation);
+  crc = crc32c(crc, raw, lo);
+  crc = crc32c(crc, &zero, sizeof(zero));
+  crc = crc32c(crc, raw + lo + sizeof(zero), EXT4_GOOD_OLD_INODE_SIZE - lo - sizeof(zero));
+  if(es.s_inode_size > EXT4_GOOD_OLD_INODE_SIZE){
+    crc = crc32c(crc, raw + EXT4_GOOD_OLD_INODE_SIZE, hi - EXT4_GOOD_OLD_INODE_SIZE);
+    if(ext4_inode_has_csum_hi((ext4_inode_t *)raw)){
+      crc = crc32c(crc, &zero, sizeof(zero));
+      hi += sizeof(zero);
+    }
+    crc = crc32c(crc, raw + hi, es.s_inode_size - hi);
   }
-  assert(free_inode_cnt == es.s_free_inodes_count);
-  assert(free_block_cnt == es.s_free_blocks_count_lo);
+  return crc;
 }
 
-extern uint32_t
-singletable_crc32c(uint32_t crc, const void *buf, uint32_t size);
+static void ext4_inode_csum_set(__u32 ino, uint8_t *raw){
+  ext4_inode_t *p = (ext4_inode_t *)raw;
+  __u32 crc;
+
+  if(!ext4_has_metadata_csum())
+    return;
+  crc = ext4_inode_csum(ino, raw);
+  p->osd2.linux2.l_i_checksum_lo = crc & 0xffff;
+  if(ext4_inode_has_csum_hi(p))
+    p->i_checksum_hi = crc >> 16;
+}
 
-extern uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
 /**
- * Read or Write super block and block group descriptor on disk.
+ * Check crc, the checksum computed of the raw inode ino, against the one in
+ * it. An inode never used (all zero) has none.
  */
-int ext4_rw_ondisk_super_bgd(int rw){
+static void ext4_inode_csum_check(__u32 ino, uint8_t *raw, __u32 crc){
+  ext4_inode_t *p = (ext4_inode_t *)raw;
+  __u32 want;
   int i;
-  ext4_super_block_t *pes = &es;
-  uint32_t crc;
 
-  if(rw == EXT4_WRITE){
-    // TODO(checksum);
-    // int chk = ext4_chksum((unsigned int *)&es, EXT4_BLOCK_SIZE/sizeof(unsigned int));
-    TODO();
-    pes->s_checksum = crc32c(pes->s_checksum, (uint8_t *)pes, 1024);
-    memcpy(ext4_block_buff, pes, sizeof(ext4_super_block_t));
+  want = p->osd2.linux2.l_i_checksum_lo;
+  if(ext4_inode_has_csum_hi(p))
+    want |= (__u32)p->i_checksum_hi << 16;
+  else
+    crc &= 0xffff;
+  if(crc == want)
+    return;
+  for(i = 0; i < es.s_inode_size; i++)
+    if(raw[i])
+      break;
+  if(i < es.s_inode_size)
+    ext4_csum_bad("inode", ino);
+}
+
+static void ext4_inode_csum_verify(__u32 ino, uint8_t *raw){
+  if(ext4_has_metadata_csum())
+    ext4_inode_csum_check(ino, raw, ext4_inode_csum(ino, raw));
+}
+
+/**
+ * Check the checksums of n (up to EXT4_CSUM_BATCH) raw inodes at once,
+ * inos[i] is the number of raws[i]. Each inode is copied into scratch with
+ * its checksum fields cleared, so that it is one buffer of crc32c_batch.
+ */
+static void ext4_inode_csum_verify_batch(__u32 *inos, uint8_t **raws, int n, uint8_t *scratch){
+  const void *bufs[EXT4_CSUM_BATCH];
+  unsigned int lens[EXT4_CSUM_BATCH];
+  __u32 crcs[EXT4_CSUM_BATCH];
+  ext4_inode_t *p;
+  int i;
+
+  for(i = 0; i < n; i++){
+    p = (ext4_inode_t *)(scratch + i * es.s_inode_size);
+    memcpy(p, raws[i], es.s_inode_size);
+    p->osd2.linux2.l_i_checksum_lo = 0;
+    if(ext4_inode_has_csum_hi(p))
+      p->i_checksum_hi = 0;
+    crcs[i] = ext4_inode_csum_seed(inos[i], p->i_generation);
+    bufs[i] = p;
+    lens[i] = es.s_inode_size;
   }
+  crc32c_batch(crcs, bufs, lens, n);
+  for(i = 0; i < n; i++)
+    ext4_inode_csum_check(inos[i], raws[i], crcs[i]);
+}
 
-  /* The first 1024 bytes (block 0) is empty , 
-    so we begin form the block 1 . */
-  ext4_rw_ondisk_block(1, ext4_block_buff, rw);
-  
-  if(rw == EXT4_READ)
-    memcpy(pes, ext4_block_buff, sizeof(ext4_super_block_t));
+/*
+ * The blocks owned by an inode read together (by a walk of its extent tree)
+ * are checked with one crc32c_batch, see ext4_csum_batch_add.
+ */
+struct ext4_csum_batch {
+  __u32 ino;
+  __u32 seed;
+  const char *what;
+  int n;
+  const void *buf[EXT4_CSUM_BATCH];
+  unsigned int len[EXT4_CSUM_BATCH];
+  __u32 want[EXT4_CSUM_BATCH];
+};
+
+static void ext4_csum_batch_init(struct ext4_csum_batch *cb, __u32 ino, ext4_inode_t *pinode, const char *what){
+  cb->ino = ino;
+  cb->seed = ext4_inode_csum_seed(ino, pinode->i_generation);
+  cb->what = what;
+  cb->n = 0;
+}
 
+/**
+ * Check the queued blocks, the batch is empty then.
+ */
+static void ext4_csum_batch_check(struct ext4_csum_batch *cb){
+  __u32 crcs[EXT4_CSUM_BATCH];
+  int i;
 
-///////////////////////////////////////////////////////////////////////////////////
-  #define offsetof(t, d) __builtin_offsetof(t, d)
-	int offset = offsetof(ext4_super_block_t, s_checksum);
+  for(i = 0; i < cb->n; i++)
+    crcs[i] = cb->seed;
+  crc32c_batch(crcs, cb->buf, cb->len, cb->n);
+  for(i = 0; i < cb->n; i++)
+    if(crcs[i] != cb->want[i])
+      ext4_csum_bad(cb->what, cb->ino);
+  cb->n = 0;
+}
 
-  ext4_super_block_t *pes2  = kmalloc(sizeof(ext4_super_block_t));
-  memcpy(pes2, pes, 1024);
-  pes2->s_checksum = 0;
-  // crc = ~0;
-  crc = crc32c(~0, (uint8_t *)pes, offset);
-  assert(crc == pes->s_checksum);
-///////////////////////////////////////////////////////////////////////////////////
+/**
+ * Queue the check of the crc32c of the first len bytes of buf against want,
+ * the batch is checked when it is full. buf must be kept until then.
+ */
+static void ext4_csum_batch_add(struct ext4_csum_batch *cb, const void *buf, unsigned int len, __u32 want){
+  cb->buf[cb->n] = buf;
+  cb->len[cb->n] = len;
+  cb->want[cb->n] = want;
+  if(++cb->n == EXT4_CSUM_BATCH)
+    ext4_csum_batch_check(cb);
+}
 
+/**
+ * The checksum of the descriptor of group (ext4_desc_size bytes at desc):
+ * the low 16 bits of crc32c with metadata_csum, crc16 with gdt_csum.
+ */
+static __u16 ext4_group_desc_csum(__u32 group, uint8_t *desc){
+  int off = __builtin_offsetof(ext4_group_desc_t, bg_checksum), size = ext4_desc_size();
+  __u16 zero = 0, crc16v;
+  __u32 crc;
+
+  if(ext4_has_metadata_csum()){
+    crc = crc32c(ext4_csum_seed, &group, sizeof(group));
+    crc = crc32c(crc, desc, off);
+    crc = crc32c(crc, &zero, sizeof(zero));
+    crc = crc32c(crc, desc + off + sizeof(zero), size - off - sizeof(zero));
+    return crc & 0xffff;
+  }
+  crc16v = crc16(~0, es.s_uuid, sizeof(es.s_uuid));
+  crc16v = crc16(crc16v, &group, sizeof(group));
+  crc16v = crc16(crc16v, desc, off);
+  return crc16(crc16v, desc + off + sizeof(zero), size - off - sizeof(zero));
+}
 
-  assert(1<<(10 + es.s_log_block_size) == EXT4_BLOCK_SIZE);
+/**
+ * Set the checksum of the descriptor of group in the descriptor table block
+ * and in egd.
+ */
+static void ext4_group_desc_csum_set(__u32 group, uint8_t *desc){
+  if(!ext4_has_group_csum())
+    return;
+  egd[group].bg_checksum = ext4_group_desc_csum(group, desc);
+  ((ext4_group_desc_t *)desc)->bg_checksum = egd[group].bg_checksum;
+}
+
+/**
+ * The tail of the extent block peh, after its eh_max entries.
+ */
+static ext4_extent_tail_t *ext4_extent_tail(ext4_extent_header_t *peh){
+  return (ext4_extent_tail_t *)((ext4_extent_t *)(peh + 1) + peh->eh_max);
+}
+
+static void ext4_extent_block_csum_verify(__u32 ino, ext4_inode_t *pinode, ext4_extent_header_t *peh){
+  __u32 crc;
+
+  if(!ext4_has_metadata_csum())
+    return;
+  crc = crc32c(ext4_inode_csum_seed(ino, pinode->i_generation), peh, (void *)ext4_extent_tail(peh) - (void *)peh);
+  if(crc != ext4_extent_tail(peh)->et_checksum)
+    ext4_csum_bad("extent block of inode", ino);
+}
+
+/**
+ * The tail of the directory leaf block, or 0 if it has none.
+ */
+static ext4_dir_entry_tail_t *ext4_dir_tail(void *block){
+  ext4_dir_entry_tail_t *t = block + EXT4_BLOCK_SIZE - sizeof(ext4_dir_entry_tail_t);
+
+  if(t->det_reserved_zero1 || t->det_rec_len != sizeof(ext4_dir_entry_tail_t) ||
+     t->det_reserved_zero2 || t->det_reserved_ft != EXT4_FT_DIR_CSUM)
+    return 0;
+  return t;
+}
+
+/**
+ * Patch the checksum in the tail of the directory block after len bytes at
+ * off of it were changed from old, only the bytes changed are hashed.
+ */
+static void ext4_dir_csum_patch(void *block, int off, const void *old, int len){
+  ext4_dir_entry_tail_t *t;
+
+  if(ext4_has_metadata_csum() && (t = ext4_dir_tail(block)))
+    t->det_checksum = crc32c_patch(t->det_checksum, old, block + off, len,
+                                   (void *)t - block - off - len);
+}
+
+static void ext4_groups_alloc();
+static void ext4_pa_discard_all();
+
+/*
+ * The super block and the group descriptors are changed in memory only, the
+ * free counts of the super block are kept along with the ones of the groups
+ * (ext4_update_free_ib_cnt), so they are never summed up again after mount.
+ * A change marks the super block and the block of the descriptor table with
+ * the group dirty, ext4_sb_commit writes back only them. It is done by
+ * ext4_sync and ext4_umount, and at the end of an allocation if the oldest
+ * change is EXT4_COMMIT_INTERVAL seconds old. The allocations and the commits
+ * may run in several threads, lock serializes them.
+ */
+static struct {
+  /* protects the super block, the descriptors, the bitmaps and the buddies */
+  pthread_mutex_t lock;
+  int dirty;
+  time_t since;       /* when the super block became dirty */
+  uint8_t *gdt_dirty; /* one for each block of the descriptor table */
+  __u32 ndirs;        /* the directories of all the groups */
+} ext4_sb = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Read or Write the super block on disk.
+ */
+static void ext4_rw_super(int rw){
+  ext4_super_block_t *pes = &es;
 
-  bg_cnts = pes->s_blocks_count_lo / pes->s_blocks_per_group + 1;
-  assert(bg_cnts < EXT4_MAX_BG_CNT);
-  assert(bg_cnts * sizeof(ext4_group_desc_t) <= sizeof(ext4_block_buff)); //assume all block group descriptors only in one block
+  if(rw == EXT4_WRITE && ext4_has_metadata_csum()){
+    /* the checksum covers everything before s_checksum, see reference 2 */
+    pes->s_checksum = crc32c(~0, (uint8_t *)pes, __builtin_offsetof(ext4_super_block_t, s_checksum));
+  }
 
-  /* read or wirte block group descriptor, padding bytes + one super block bytes occupy block 0 and block 1, so 
-    the block of "block group descriptor" begin with 2 */
+  /* The first 1024 bytes is empty, the super block follows it,
+    it is in block 1 for 1K blocks and in block 0 for larger blocks.
+    The block may hold other data, so it is read before written. */
+  ext4_rw_ondisk_block(EXT4_GROUP0_PADDING_BYTES / EXT4_BLOCK_SIZE, ext4_block_buff, EXT4_READ);
+  if(rw == EXT4_READ){
+    memcpy(pes, ext4_block_buff + EXT4_GROUP0_PADDING_BYTES % EXT4_BLOCK_SIZE, sizeof(ext4_super_block_t));
+  } else {
+    memcpy(ext4_block_buff + EXT4_GROUP0_PADDING_BYTES % EXT4_BLOCK_SIZE, pes, sizeof(ext4_super_block_t));
+    ext4_rw_ondisk_block(EXT4_GROUP0_PADDING_BYTES / EXT4_BLOCK_SIZE, ext4_block_buff, rw);
+  }
+
+  if(rw == EXT4_READ && ext4_has_metadata_csum() &&
+     pes->s_checksum != crc32c(~0, (uint8_t *)pes, __builtin_offsetof(ext4_super_block_t, s_checksum)))
+    ext4_csum_bad("super block", 0);
+}
+
+/**
+ * Read or Write super block and block group descriptor on disk.
+ */
+int ext4_rw_ondisk_super_bgd(int rw){
+  int i, desc_size, copy_size, ngdt;
+  ext4_super_block_t *pes = &es;
+  uint8_t *gdt;
+
+  ext4_rw_super(rw);
+  assert(1<<(10 + es.s_log_block_size) == EXT4_BLOCK_SIZE);
+  if(rw == EXT4_READ)
+    ext4_csum_init();
+
+  bg_cnts = (pes->s_blocks_count_lo - pes->s_first_data_block + pes->s_blocks_per_group - 1) / pes->s_blocks_per_group;
+  /* the descriptors are spread over the disk with meta_bg */
+  if(es.s_feature_incompat & EXT4_FEATURE_INCOMPAT_META_BG)
+    panic("meta_bg is not supported");
+  desc_size = ext4_desc_size();
+  copy_size = desc_size < sizeof(ext4_group_desc_t) ? desc_size : sizeof(ext4_group_desc_t);
   if(rw == EXT4_READ)
-    ext4_rw_ondisk_block(2, ext4_block_buff, rw);
+    ext4_groups_alloc();
+
+  /* the block group descriptor table begins with the block after the super block
+    (block 2 for 1K blocks, block 1 otherwise), all of its blocks are read with
+    one request. The table is read before written, the tail of its last block
+    may hold other data. */
+  ngdt = ext4_gdt_blocks();
+  gdt = bpool_alloc(ngdt * EXT4_BLOCK_SIZE);
+  ext4_rw_ondisk_blocks(es.s_first_data_block + 1, ngdt, gdt, EXT4_READ);
 
-  int free_inode_cnt = 0, free_block_cnt = 0;
   for(i = 0; i < bg_cnts; i++){
-    if(rw == EXT4_READ)
-      memcpy(egd + i, ext4_block_buff + i*sizeof(ext4_group_desc_t), sizeof(ext4_group_desc_t));
-    else if (rw == EXT4_WRITE)
-      memcpy(ext4_block_buff + i*sizeof(ext4_group_desc_t), egd+i, sizeof(ext4_group_desc_t));
-    else 
+    if(rw == EXT4_READ){
+      memcpy(egd + i, gdt + i * desc_size, copy_size);
+      if(ext4_has_group_csum() && egd[i].bg_checksum != ext4_group_desc_csum(i, gdt + i * desc_size))
+        ext4_csum_bad("descriptor of group", i);
+    } else if (rw == EXT4_WRITE){
+      memcpy(gdt + i * desc_size, egd + i, copy_size);
+      ext4_group_desc_csum_set(i, gdt + i * desc_size);
+    } else 
       panic("error");
-    free_inode_cnt += egd[i].bg_free_inodes_count_lo;
-    free_block_cnt += egd[i].bg_free_blocks_count_lo;
   }
   if(rw == EXT4_WRITE)
-    ext4_rw_ondisk_block(2, ext4_block_buff, rw);
+    ext4_rw_ondisk_blocks(es.s_first_data_block + 1, ngdt, gdt, rw);
+  bpool_free(gdt, ngdt * EXT4_BLOCK_SIZE);
+
+  /* the totals are kept along with the counts of the groups from now on,
+    they are only summed up here */
+  if(rw == EXT4_READ){
+    int free_inode_cnt = 0, free_block_cnt = 0;
+    ext4_sb.ndirs = 0;
+    for(i = 0; i < bg_cnts; i++){
+      free_inode_cnt += egd[i].bg_free_inodes_count_lo;
+      free_block_cnt += egd[i].bg_free_blocks_count_lo;
+      ext4_sb.ndirs += egd[i].bg_used_dirs_count_lo;
+    }
+    assert(free_inode_cnt == es.s_free_inodes_count);
+    assert(free_block_cnt == es.s_free_blocks_count_lo);
+  } else {
+    memset(ext4_sb.gdt_dirty, 0, ngdt);
+    ext4_sb.dirty = 0;
+  }
+  return 0;
+}
+
+/**
+ * Mark the descriptor of group and the super block dirty.
+ */
+static void ext4_group_dirty(int group){
+  ext4_sb.gdt_dirty[group * ext4_desc_size() / EXT4_BLOCK_SIZE] = 1;
+  if(!ext4_sb.dirty){
+    ext4_sb.dirty = 1;
+    ext4_sb.since = time(0);
+  }
+}
 
-  assert(free_inode_cnt == es.s_free_inodes_count);
-  assert(free_block_cnt == es.s_free_blocks_count_lo);
+/**
+ * Write back the super block and the dirty blocks of the descriptor table
+ * (into the buffer cache), return the counts of blocks written.
+ */
+int ext4_sb_commit(){
+  int b, i, n = 0, desc_size = ext4_desc_size();
+  int copy_size = desc_size < sizeof(ext4_group_desc_t) ? desc_size : sizeof(ext4_group_desc_t);
+  int per_block = EXT4_BLOCK_SIZE / desc_size;
+
+  pthread_mutex_lock(&ext4_sb.lock);
+  if(!ext4_sb.dirty){
+    pthread_mutex_unlock(&ext4_sb.lock);
+    return 0;
+  }
+  for(b = 0; b < ext4_gdt_blocks(); b++){
+    if(!ext4_sb.gdt_dirty[b])
+      continue;
+    ext4_rw_ondisk_block(es.s_first_data_block + 1 + b, ext4_block_buff, EXT4_READ);
+    for(i = b * per_block; i < bg_cnts && i < (b + 1) * per_block; i++){
+      memcpy(ext4_block_buff + (i - b * per_block) * desc_size, egd + i, copy_size);
+      ext4_group_desc_csum_set(i, ext4_block_buff + (i - b * per_block) * desc_size);
+    }
+    ext4_rw_ondisk_block(es.s_first_data_block + 1 + b, ext4_block_buff, EXT4_WRITE);
+    ext4_sb.gdt_dirty[b] = 0;
+    n++;
+  }
+  es.s_wtime = time(0);
+  ext4_rw_super(EXT4_WRITE);
+  ext4_sb.dirty = 0;
+  pthread_mutex_unlock(&ext4_sb.lock);
+  return n + 1;
+}
+
+/**
+ * Commit the super block and the descriptors with the bitmaps to the disk if
+ * they have been dirty for EXT4_COMMIT_INTERVAL seconds, at the end of an
+ * allocation.
+ */
+static void ext4_commit_maybe(){
+  int due;
+
+  pthread_mutex_lock(&ext4_sb.lock);
+  due = ext4_sb.dirty && time(0) - ext4_sb.since >= EXT4_COMMIT_INTERVAL;
+  pthread_mutex_unlock(&ext4_sb.lock);
+  if(due){
+    ext4_pa_discard_all();
+    ext4_bitmap_sync();
+    ext4_sb_commit();
+    bsync(ext4_dev);
+  }
+}
+
+/**
+ * Open the image at path as device dev and read its super block and
+ * block group descriptors. flags are passed to bdev_open, use BDEV_MMAP
+ * for read only jobs.
+ */
+int ext4_mount(uint32_t dev, const char *path, int flags){
+  struct iovec iov = {
+    .iov_base = &es,
+    .iov_len = sizeof(ext4_super_block_t),
+  };
+
+  if(bdev_open(dev, path, flags) < 0)
+    return -1;
+  ext4_dev = dev;
+
+  /* the block size is unknown yet, read the super block in sectors */
+  breadv(dev, EXT4_GROUP0_PADDING_BYTES / SECTOR_SIZE, &iov, 1);
+  if(es.s_magic != EXT4_SUPER_MAGIC || es.s_log_block_size > 6){
+    printf(rd("not an ext4 image: %s\n"), path);
+    bdev_close(dev);
+    return -1;
+  }
+  ext4_block_bits = 10 + es.s_log_block_size;
+  ext4_block_size = 1 << ext4_block_bits;
+
+  /* blockno of bread is counted in ext4 blocks from now on */
+  bdev_set_bsize(dev, EXT4_BLOCK_SIZE);
+  ext4_rw_ondisk_super_bgd(EXT4_READ);
+  return 0;
+}
+
+static void ext4_iinval();
+static void ext4_bitmap_drop();
+static uint8_t *ext4_get_bitmap(int group, int type);
+static void ext4_groups_free();
+
+#define EXT4_BITMAP_BLOCK 0
+#define EXT4_BITMAP_INODE 1
+
+/**
+ * Write back the dirty inodes and bitmaps, super block and block group descriptors and
+ * all the dirty cached blocks, then close the device.
+ */
+void ext4_umount(){
+  ext4_da_sync();
+  ext4_pa_discard_all();
+  ext4_iinval();
+  ext4_bitmap_drop();
+  if(!(bdev_get(ext4_dev)->flags & BDEV_RDONLY))
+    ext4_sb_commit();
+  bsync(ext4_dev);
+  ext4_groups_free();
+  bdev_close(ext4_dev);
 }
 
 /**
@@ -183,31 +654,406 @@ int ext4_itable_off(int inode_num){
 }
 
 /**
- * Read or write the inode with number inode_num 
+ * Return the block of the inode table which holds inode ino,
+ * and the offset of the inode in it.
+ */
+static int ext4_inode_blockno(__u32 ino, int *inode_block_off){
+  int itable_off = ext4_itable_off(ino);
+
+  *inode_block_off = itable_off & (EXT4_BLOCK_SIZE - 1);
+  return egd[ext4_bg_inode_livein(ino)].bg_inode_table_lo + (itable_off >> EXT4_BLOCK_SIZE_BITS);
+}
+
+/*
+ * The inode cache, inodes looked up recently are kept in memory so that
+ * the hot ones (root, parent directories) do not touch the device.
+ * A changed inode is only marked dirty, the dirty inodes are written back
+ * together by ext4_isync, with one read-modify-write per inode table block.
+ */
+struct {
+  /* protects the hash chains, the LRU list, ino, ref and dirty of the inodes.
+    d of an inode is protected by its sleep lock. */
+  pthread_mutex_t lock;
+  ext4_minode_t inode[EXT4_NINODE];
+  ext4_minode_t head;
+  ext4_minode_t *hash[EXT4_NINODE];
+} icache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static ext4_minode_t **ext4_ihash(__u32 ino){
+  return &icache.hash[ino % EXT4_NINODE];
+}
+
+static void ext4_iinit(){
+  ext4_minode_t *ip;
+
+  icache.head.prev = &icache.head;
+  icache.head.next = &icache.head;
+  for(ip = icache.inode; ip < icache.inode + EXT4_NINODE; ip++){
+    initsleeplock(&ip->lock);
+    ip->next = icache.head.next;
+    ip->prev = &icache.head;
+    icache.head.next->prev = ip;
+    icache.head.next = ip;
+  }
+}
+
+static void ext4_iunhash(ext4_minode_t *ip){
+  ext4_minode_t **pp;
+
+  for(pp = ext4_ihash(ip->ino); *pp; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      break;
+    }
+  }
+  ip->hnext = 0;
+  ip->ino = 0;
+}
+
+/**
+ * The bytes of ext4_inode_t kept in an inode table slot, a 128 byte inode
+ * has none of the fields after i_osd2.
+ */
+static int ext4_inode_ondisk_size(){
+  return es.s_inode_size < sizeof(ext4_inode_t) ? es.s_inode_size : sizeof(ext4_inode_t);
+}
+
+/* a dirty inode collected by ext4_isync, and if it was locked by ext4_isync */
+struct ext4_isync_ent {
+  ext4_minode_t *ip;
+  int locked;
+};
+
+static int ext4_icmp_ino(const void *a, const void *b){
+  __u32 x = ((struct ext4_isync_ent *)a)->ip->ino, y = ((struct ext4_isync_ent *)b)->ip->ino;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Write back the dirty inodes, the inodes in the same inode table block
+ * share one read-modify-write of it. An inode locked by another thread is
+ * being changed, it is left dirty. Return the counts of inodes written.
+ */
+int ext4_isync(){
+  struct ext4_isync_ent dirty[EXT4_NINODE];
+  ext4_minode_t *ip;
+  int i, j, n = 0, m = 0, blockno, off;
+  buf_t *b;
+
+  pthread_mutex_lock(&icache.lock);
+  for(ip = icache.inode; ip < icache.inode + EXT4_NINODE; ip++){
+    if(ip->ino && ip->dirty){
+      ip->ref++;
+      dirty[n++].ip = ip;
+    }
+  }
+  pthread_mutex_unlock(&icache.lock);
+
+  for(i = 0; i < n; i++){
+    ip = dirty[i].ip;
+    if(holdingsleep(&ip->lock))
+      dirty[i].locked = 0;
+    else if(tryacquiresleep(&ip->lock))
+      dirty[i].locked = 1;
+    else {
+      pthread_mutex_lock(&icache.lock);
+      ip->ref--;
+      pthread_mutex_unlock(&icache.lock);
+      continue;
+    }
+    dirty[m++] = dirty[i];
+  }
+  n = m;
+  /* the inodes of one block are adjacent after sorting by number */
+  qsort(dirty, n, sizeof(dirty[0]), ext4_icmp_ino);
+
+  for(i = 0; i < n; i = j){
+    blockno = ext4_inode_blockno(dirty[i].ip->ino, &off);
+    b = bread(ext4_dev, blockno);
+    for(j = i; j < n && ext4_inode_blockno(dirty[j].ip->ino, &off) == blockno; j++){
+      memcpy(b->data + off, &dirty[j].ip->d, ext4_inode_ondisk_size());
+      ext4_inode_csum_set(dirty[j].ip->ino, b->data + off);
+    }
+    bwrite(b);
+    brelse(b);
+  }
+
+  for(i = 0; i < n; i++){
+    ip = dirty[i].ip;
+    pthread_mutex_lock(&icache.lock);
+    ip->dirty = 0;
+    ip->ref--;
+    pthread_mutex_unlock(&icache.lock);
+    if(dirty[i].locked)
+      releasesleep(&ip->lock);
+  }
+  return n;
+}
+
+/**
+ * Write back the dirty inodes and drop all the cached ones, at umount.
+ */
+static void ext4_iinval(){
+  ext4_minode_t *ip;
+
+  ext4_isync();
+  pthread_mutex_lock(&icache.lock);
+  for(ip = icache.inode; ip < icache.inode + EXT4_NINODE; ip++){
+    if(ip->ino == 0)
+      continue;
+    assert(ip->ref == 0 && !ip->dirty);
+    ext4_iunhash(ip);
+  }
+  pthread_mutex_unlock(&icache.lock);
+}
+
+/**
+ * Read inode ino from the inode table into ip->d, ip is locked.
+ * The fields not on disk (of a 128 byte inode) are zero.
+ */
+static void ext4_iload(ext4_minode_t *ip){
+  int blockno, off, size = ext4_inode_ondisk_size();
+  uint8_t *p;
+  buf_t *b;
+
+  blockno = ext4_inode_blockno(ip->ino, &off);
+  memset((uint8_t *)&ip->d + size, 0, sizeof(ext4_inode_t) - size);
+  /* a mapped image need not to be cached */
+  if((p = bmap(ext4_dev, blockno, 1))){
+    ext4_inode_csum_verify(ip->ino, p + off);
+    memcpy(&ip->d, p + off, size);
+    return;
+  }
+  b = bread(ext4_dev, blockno);
+  ext4_inode_csum_verify(ip->ino, b->data + off);
+  memcpy(&ip->d, b->data + off, size);
+  brelse(b);
+}
+
+/**
+ * Return the locked in-memory inode ino, it is read from the inode table
+ * if it is not cached. Call ext4_iput when done with it.
+ */
+ext4_minode_t *ext4_iget(__u32 ino){
+  ext4_minode_t *ip, *victim;
+  int has_dirty;
+
+  assert(ino > 0 && ino <= es.s_inodes_count);
+  for(;;){
+    pthread_mutex_lock(&icache.lock);
+    if(icache.head.next == 0)
+      ext4_iinit();
+    for(ip = *ext4_ihash(ino); ip; ip = ip->hnext){
+      if(ip->ino == ino){
+        ip->ref++;
+        pthread_mutex_unlock(&icache.lock);
+        acquiresleep(&ip->lock);
+        return ip;
+      }
+    }
+
+    /* recycle the least recently used unreferenced clean inode */
+    victim = 0;
+    has_dirty = 0;
+    for(ip = icache.head.prev; ip != &icache.head; ip = ip->prev){
+      if(ip->ref != 0)
+        continue;
+      if(ip->dirty){
+        has_dirty = 1;
+        continue;
+      }
+      victim = ip;
+      break;
+    }
+    if(victim){
+      if(victim->ino)
+        ext4_iunhash(victim);
+      victim->ino = ino;
+      victim->ref = 1;
+      victim->hnext = *ext4_ihash(ino);
+      *ext4_ihash(ino) = victim;
+      /* nobody holds an unreferenced inode, it does not sleep */
+      acquiresleep(&victim->lock);
+      pthread_mutex_unlock(&icache.lock);
+      ext4_iload(victim);
+      return victim;
+    }
+    pthread_mutex_unlock(&icache.lock);
+    if(!has_dirty)
+      panic("iget: no inodes");
+    ext4_isync();
+  }
+}
+
+/**
+ * Mark the locked inode ip dirty, it is written back by ext4_isync.
+ */
+void ext4_idirty(ext4_minode_t *ip){
+  assert(holdingsleep(&ip->lock));
+  pthread_mutex_lock(&icache.lock);
+  ip->dirty = 1;
+  pthread_mutex_unlock(&icache.lock);
+}
+
+/**
+ * Unlock and drop the reference of ip, and move it to the head of the LRU list.
+ */
+void ext4_iput(ext4_minode_t *ip){
+  assert(holdingsleep(&ip->lock));
+  releasesleep(&ip->lock);
+
+  pthread_mutex_lock(&icache.lock);
+  assert(ip->ref > 0);
+  if(--ip->ref == 0){
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+    ip->next = icache.head.next;
+    ip->prev = &icache.head;
+    icache.head.next->prev = ip;
+    icache.head.next = ip;
+  }
+  pthread_mutex_unlock(&icache.lock);
+}
+
+/**
+ * Read or write the inode with number inode_num through the inode cache,
+ * a write only changes the cached inode, it reaches the inode table at
+ * ext4_isync (ext4_umount) or when the inode is evicted.
  */
 void ext4_rw_ondisk_inode(int inode_num, ext4_inode_t *pinode, int rw){
-  // ext4_inode_t *pinode = &inode;
-  // ext4_extent_header_t *peh;
-  int bg_inode_livein = ext4_bg_inode_livein(inode_num);
-  int itable_off = ext4_itable_off(inode_num);
-  int inode_block_idx = itable_off / EXT4_BLOCK_SIZE;
-  int inode_block_off = itable_off % EXT4_BLOCK_SIZE;
-  int blockno = egd[bg_inode_livein].bg_inode_table_lo + inode_block_idx;
-
-  ext4_rw_ondisk_block(blockno, ext4_block_buff, EXT4_READ);
+  ext4_minode_t *ip = ext4_iget(inode_num);
+
   if(rw == EXT4_READ)
-    memcpy(pinode, ext4_block_buff + inode_block_off, sizeof(ext4_inode_t));
+    memcpy(pinode, &ip->d, sizeof(ext4_inode_t));
   else if (rw == EXT4_WRITE) {
-    /* Confirm there is no content before */
-    assert(*(uint64_t *)(ext4_block_buff + inode_block_off) == 0);
-    memcpy(ext4_block_buff + inode_block_off, pinode, sizeof(ext4_inode_t));
-    ext4_rw_ondisk_block(blockno, ext4_block_buff, rw);
+    memcpy(&ip->d, pinode, sizeof(ext4_inode_t));
+    ext4_idirty(ip);
   } else {
     panic("rw error");
   }
+  ext4_iput(ip);
   assert(pinode->i_flags | EXT4_EXTENTS_FL);
 }
 
+/**
+ * Prepare the scan of s->group, return 0 if none of its inodes is in use.
+ * The never used tail of the inode table (bg_itable_unused_lo) and the
+ * groups whose inode table is not initialized are skipped.
+ */
+static int ext4_iscan_group(struct ext4_iscan *s){
+  ext4_group_desc_t *gd = &egd[s->group];
+
+  s->idx = 0;
+  s->start = s->end = 0;
+  s->nused = es.s_inodes_per_group;
+  if(ext4_has_group_csum()){
+    if(gd->bg_flags & EXT4_BG_INODE_UNINIT)
+      return 0;
+    s->nused -= gd->bg_itable_unused_lo;
+  }
+  if(s->nused == 0)
+    return 0;
+  /* the resident one, with the inodes allocated since the last bitmap sync */
+  s->bitmap = ext4_get_bitmap(s->group, EXT4_BITMAP_INODE);
+  return 1;
+}
+
+/**
+ * Move the scan to the first group from s->group that has inodes in use.
+ */
+static void ext4_iscan_seek_group(struct ext4_iscan *s){
+  for(; s->group < bg_cnts; s->group++)
+    if(ext4_iscan_group(s))
+      return;
+}
+
+/**
+ * Begin a scan of all the in-use inodes in the order of inode number.
+ * The dirty cached inodes are written into the buffer cache first, and the
+ * resident inode bitmaps are used, so that the scan sees the new inodes.
+ */
+void ext4_iscan_start(struct ext4_iscan *s){
+  ext4_isync();
+  memset(s, 0, sizeof(*s));
+  s->itable_buff = bpool_alloc(EXT4_ISCAN_BLOCKS * EXT4_BLOCK_SIZE);
+  s->csum_buff = bpool_alloc(EXT4_CSUM_BATCH * es.s_inode_size);
+  ext4_iscan_seek_group(s);
+}
+
+/**
+ * Check the checksums of the in-use inodes of the run of the inode table
+ * just read, EXT4_CSUM_BATCH of them at a time.
+ */
+static void ext4_iscan_verify(struct ext4_iscan *s){
+  __u32 inos[EXT4_CSUM_BATCH];
+  uint8_t *raws[EXT4_CSUM_BATCH];
+  int i = s->idx, n = 0, end = s->end < s->nused ? s->end : s->nused;
+
+  if(!ext4_has_metadata_csum())
+    return;
+  while((i = bitmap_find_one(s->bitmap, i, end)) >= 0){
+    inos[n] = s->group * es.s_inodes_per_group + i + 1;
+    raws[n] = s->itable + (i - s->start) * es.s_inode_size;
+    if(++n == EXT4_CSUM_BATCH){
+      ext4_inode_csum_verify_batch(inos, raws, n, s->csum_buff);
+      n = 0;
+    }
+    i++;
+  }
+  ext4_inode_csum_verify_batch(inos, raws, n, s->csum_buff);
+}
+
+/**
+ * Return the next in-use inode and set *ino to its number, or return 0
+ * at the end of the scan. The inode is a copy in s, valid until the next call.
+ * The inode table is read in runs of up to EXT4_ISCAN_BLOCKS blocks, a run
+ * begins with the block of the next inode allocated in the inode bitmap,
+ * so the blocks of free inodes are skipped.
+ */
+ext4_inode_t *ext4_iscan_next(struct ext4_iscan *s, __u32 *ino){
+  __u32 per_block = EXT4_BLOCK_SIZE / es.s_inode_size;
+  __u32 first, cnt;
+  int i, size = ext4_inode_ondisk_size();
+  uint8_t *raw;
+
+  while(s->group < bg_cnts){
+    /* the next allocated inode of the group */
+    i = bitmap_find_one(s->bitmap, s->idx, s->nused);
+    if(i < 0){
+      s->group++;
+      ext4_iscan_seek_group(s);
+      continue;
+    }
+    s->idx = i;
+
+    if(s->idx < s->start || s->idx >= s->end){
+      first = s->idx / per_block;
+      cnt = (s->nused + per_block - 1) / per_block - first;
+      if(cnt > EXT4_ISCAN_BLOCKS)
+        cnt = EXT4_ISCAN_BLOCKS;
+      s->itable = ext4_map_blocks(egd[s->group].bg_inode_table_lo + first, cnt, s->itable_buff);
+      s->start = first * per_block;
+      s->end = (first + cnt) * per_block;
+      ext4_iscan_verify(s);
+    }
+
+    *ino = s->group * es.s_inodes_per_group + s->idx + 1;
+    raw = s->itable + (s->idx - s->start) * es.s_inode_size;
+    s->idx++;
+    /* the fields past s_inode_size (128 byte inodes) are zero */
+    memcpy(&s->inode, raw, size);
+    memset((uint8_t *)&s->inode + size, 0, sizeof(ext4_inode_t) - size);
+    return &s->inode;
+  }
+  return 0;
+}
+
+void ext4_iscan_end(struct ext4_iscan *s){
+  bpool_free(s->itable_buff, EXT4_ISCAN_BLOCKS * EXT4_BLOCK_SIZE);
+  bpool_free(s->csum_buff, EXT4_CSUM_BATCH * es.s_inode_size);
+}
+
 /**
  * Convert the dir entry on disk to struct linux_dirent64. 
  * A phony struct ext4_dir_entry is placed at the end of block.
@@ -215,8 +1061,7 @@ void ext4_rw_ondisk_inode(int inode_num, ext4_inode_t *pinode, int rw){
  * NOTE there is no '\0' on the disk, and the name_len of ext4_dir_entry_2
  * do not contain it.
  */
-void ext4_get_linux_dirent64(int offset, void *buf, int len, void *imap_block_buff){
-  int remain_size = EXT4_BLOCK_SIZE;
+static inline void ext4_get_linux_dirent64_bs(const int bs, int offset, void *buf, int len, void *imap_block_buff){
   int block_off = 0;
   ext4_dir_entry_2_t *p_dir_entry;
   struct linux_dirent64* plinux_dirent64;
@@ -225,7 +1070,7 @@ void ext4_get_linux_dirent64(int offset, void *buf, int len, void *imap_block_bu
   
   /*we need to look throu the hole block, becase when we rename a file
     with longer name, its direntry location maybe changed.*/
-  while(1){
+  while(block_off < bs){
     p_dir_entry = (ext4_dir_entry_2_t *)(imap_block_buff + block_off);
     plinux_dirent64 = (struct linux_dirent64 *)(buf + offset);
 
@@ -249,21 +1094,104 @@ void ext4_get_linux_dirent64(int offset, void *buf, int len, void *imap_block_bu
   }
 }
 
+void ext4_get_linux_dirent64(int offset, void *buf, int len, void *imap_block_buff){
+  EXT4_SPECIALIZE_BLOCK_SIZE(ext4_get_linux_dirent64_bs, offset, buf, len, imap_block_buff);
+}
+
+/*
+ * A run of contiguous blocks read by one request.
+ */
+struct ext4_run {
+  int blockno;
+  int cnt;
+  void *data;
+};
+
+/**
+ * Read nrun runs with one batch, the i-th run is read into buff one after
+ * another and runs[i].data is set to it. If the image is mapped, runs[i].data
+ * points into the mapping and buff is not used (may be 0).
+ */
+static void ext4_read_runs(struct ext4_run *runs, int nrun, void *buff){
+  struct bio_batch batch;
+  int i;
+
+  assert(nrun <= BIO_BATCH_MAX);
+  bio_batch_init(&batch);
+  for(i = 0; i < nrun; i++){
+    runs[i].data = bmap(ext4_dev, runs[i].blockno, runs[i].cnt);
+    if(runs[i].data)
+      continue;
+    runs[i].data = buff;
+    buff += runs[i].cnt * EXT4_BLOCK_SIZE;
+    bio_batch_add(&batch, ext4_dev, runs[i].blockno, runs[i].cnt, runs[i].data);
+  }
+  bio_batch_wait(&batch);
+}
+
+/**
+ * Convert the dir entries in the data blocks of the runs.
+ * The checksums of the blocks are verified in batches if cb is not 0.
+ */
+static void ext4_runs_get_linux_dirent64(struct ext4_run *runs, int nrun, int offset, void *buf, int len,
+                                         struct ext4_csum_batch *cb){
+  ext4_dir_entry_tail_t *t;
+  void *block;
+  int i, k;
+
+  for(i = 0; i < nrun; i++){
+    for(k = 0; k < runs[i].cnt; k++){
+      block = runs[i].data + k*EXT4_BLOCK_SIZE;
+      if(cb && (t = ext4_dir_tail(block)))
+        ext4_csum_batch_add(cb, block, (void *)t - block, t->det_checksum);
+      ext4_get_linux_dirent64(offset, buf, len, block);
+    }
+  }
+  /* the blocks are reused by the next runs */
+  if(cb)
+    ext4_csum_batch_check(cb);
+}
+
+/**
+ * Verify the checksums of the extent blocks of the runs (one block each)
+ * with one batch.
+ */
+static void ext4_runs_extent_csum_verify(struct ext4_run *runs, int nrun, struct ext4_csum_batch *cb){
+  ext4_extent_header_t *peh;
+  int i;
+
+  for(i = 0; i < nrun; i++){
+    peh = (ext4_extent_header_t *)runs[i].data;
+    ext4_csum_batch_add(cb, peh, (void *)ext4_extent_tail(peh) - (void *)peh, ext4_extent_tail(peh)->et_checksum);
+  }
+  ext4_csum_batch_check(cb);
+}
+
 /**
  * Tranverse the tree in preorder to get its data blocks
  * If this functiosn have multiple use, we can use function handler and __VA_ARGS__.
  * to do the following tasks:
  * 1. Read directory entries.
+ * The blocks of all the extents of a leaf (and all the children of an index node)
+ * are read in batches, see bio_batch.
+ * If ino (the number of the directory pdir) is not 0 and there is metadata_csum,
+ * the checksums of the extent blocks and directory blocks read are verified,
+ * a batch of them at a time.
  */
-void ext4_traverse_extent_tree_recursively(ext4_extent_header_t *peh, int offset, void *buf, int len){
+void ext4_traverse_extent_tree_recursively(__u32 ino, ext4_inode_t *pdir, ext4_extent_header_t *peh, int offset, void *buf, int len){
   int i, j;
   // ext4_extent_header_t *peh_next_level;
   ext4_extent_idx_t *pextent_idx;
   ext4_extent_t *pextent, *pextent_temp;
   // void *data_block_buff;
-  void *imap_block_buff = kmalloc(EXT4_BLOCK_SIZE);
+  /* no scratch buffer is needed if the image is mapped */
+  int mapped = bdev_get(ext4_dev)->map != 0;
+  void *run_buff = 0;
+  struct ext4_run runs[BIO_BATCH_MAX];
+  int nrun = 0, filled = 0, run;
+  struct ext4_csum_batch batch, *cb = 0;
 
-  assert(peh->eh_magic = EXT4_EH_MAGIC);
+  assert(peh->eh_magic == EXT4_EH_MAGIC);
   assert(sizeof(ext4_extent_header_t) == sizeof(ext4_extent_idx_t));
   assert(sizeof(ext4_extent_idx_t) == sizeof(ext4_extent_t));
   /* The three struct has the same size (12 bytes) and the former two
@@ -271,30 +1199,75 @@ void ext4_traverse_extent_tree_recursively(ext4_extent_header_t *peh, int offset
   
   pextent_idx = (ext4_extent_idx_t *)peh + 1; 
   pextent = (ext4_extent_t *)peh + 1;
+  if(ino && ext4_has_metadata_csum()){
+    cb = &batch;
+    ext4_csum_batch_init(cb, ino, pdir, peh->eh_depth == 0 ? "directory block of inode" : "extent block of inode");
+  }
 
   if(peh->eh_depth == 0){
-    // data_block_buff = kmalloc(EXT4_BLOCK_SIZE);
+    if(!mapped)
+      run_buff = bpool_alloc(EXT4_BATCH_BLOCKS * EXT4_BLOCK_SIZE);
     for(i = 0; i < peh->eh_entries; i++){
       /* get the ext4_extent_t structure */
       pextent_temp = pextent + i; 
-      for(j = 0; j < pextent_temp->ee_len; j++){
-        ext4_rw_ondisk_block(pextent_temp->ee_start_lo + j, imap_block_buff, EXT4_READ);
-        // todo();
-        ext4_get_linux_dirent64(offset, buf, len, imap_block_buff);
+      /* split the physical run of the extent into as few requests as possible */
+      for(j = 0; j < pextent_temp->ee_len; j += run){
+        run = pextent_temp->ee_len - j;
+        if(run > EXT4_MAX_RW_BLOCKS)
+          run = EXT4_MAX_RW_BLOCKS;
+        if(nrun == BIO_BATCH_MAX || filled + run > EXT4_BATCH_BLOCKS){
+          ext4_read_runs(runs, nrun, run_buff);
+          ext4_runs_get_linux_dirent64(runs, nrun, offset, buf, len, cb);
+          nrun = filled = 0;
+        }
+        runs[nrun].blockno = pextent_temp->ee_start_lo + j;
+        runs[nrun].cnt = run;
+        nrun++;
+        filled += run;
       }
     }
-    // kfree(data_block_buff);
+    ext4_read_runs(runs, nrun, run_buff);
+    ext4_runs_get_linux_dirent64(runs, nrun, offset, buf, len, cb);
   } else {
-    for(i = 0; i < peh->eh_entries; i++){
-      /* read the extent header in the next level of the tree */
+    if(!mapped)
+      run_buff = bpool_alloc(BIO_BATCH_MAX * EXT4_BLOCK_SIZE);
+    for(i = 0; i < peh->eh_entries; i += nrun){
+      /* read the extent headers in the next level of the tree */
       // peh_next_level = kmalloc(EXT4_BLOCK_SIZE);
-      ext4_rw_ondisk_block((pextent_idx + i)->ei_leaf_lo, imap_block_buff, EXT4_READ);
-      ext4_traverse_extent_tree_recursively((ext4_extent_header_t *)imap_block_buff, offset, buf, len);
+      nrun = peh->eh_entries - i;
+      if(nrun > BIO_BATCH_MAX)
+        nrun = BIO_BATCH_MAX;
+      for(j = 0; j < nrun; j++){
+        runs[j].blockno = (pextent_idx + i + j)->ei_leaf_lo;
+        runs[j].cnt = 1;
+      }
+      ext4_read_runs(runs, nrun, run_buff);
+      if(cb)
+        ext4_runs_extent_csum_verify(runs, nrun, cb);
+      for(j = 0; j < nrun; j++)
+        ext4_traverse_extent_tree_recursively(ino, pdir, (ext4_extent_header_t *)runs[j].data, offset, buf, len);
       // ext4_traverse_extent_tree_recursively(peh_next_level);
       // kfree(peh_next_level);
     }
   }
-  kfree(imap_block_buff);
+  bpool_free(run_buff, peh->eh_depth == 0 ? EXT4_BATCH_BLOCKS * EXT4_BLOCK_SIZE : BIO_BATCH_MAX * EXT4_BLOCK_SIZE);
+}
+
+/**
+ * Return the inode number of the directory pdir, it is not kept in the inode
+ * but in the "." entry at the beginning of its first block.
+ */
+static __u32 ext4_dir_ino(ext4_inode_t *pdir){
+  ext4_extent_t extent;
+  buf_t *b;
+  __u32 ino;
+
+  if(ext4_find_extent(pdir, 0, &extent) < 0)
+    panic("directory without blocks");
+  b = bread(ext4_dev, extent.ee_start_lo);
+  ino = ((ext4_dir_entry_2_t *)b->data)->inode;
+  brelse(b);
+  return ino;
 }
 
 /**
@@ -312,38 +1285,467 @@ int ext4_readdir(ext4_inode_t *pinode, int offset, void *buf, int len){
     is at the next of ext4_extent_header */
   // pextent_idx = pextent = peh + 1;
 
-  assert(peh->eh_magic = EXT4_EH_MAGIC);
+  assert(peh->eh_magic == EXT4_EH_MAGIC);
   assert(pinode->i_flags & EXT4_EXTENTS_FL);
   assert(!(pinode->i_flags & EXT4_INDEX_FL));
   assert(offset == 0);
 
-  ext4_traverse_extent_tree_recursively(peh, offset, buf, len);
-  // if(peh->eh_depth == 0){
-  //   data_block_buff = kmalloc(EXT4_BLOCK_SIZE);
-  //   for(i = 0; i < peh->eh_entries; i++){
-  //     pextent_temp = pextent + i; 
-  //     for(j = 0; j < pextent_temp->ee_len; i++){
-  //       ext4_read_ondisk_block(pextent_temp + j, data_block_buff);    
-  //       todo();
-  //     }
-  //   }
-  //   kfree(data_block_buff);
-  // } else {
-  //   for(i = 0; i < peh->eh_entries; i++){
-  //     /* read the extent header in the next level of the tree */
-  //     peh_next_level = kmalloc(EXT4_BLOCK_SIZE);
-  //     ext4_read_ondisk_block((pextent_idx + i)->ei_leaf_lo, peh_next_level);
-  //     ext4_traverse_extent_tree_recursively(peh_next_level);
-  //     kfree(peh_next_level);
-  //   }
-  // }
+  ext4_traverse_extent_tree_recursively(ext4_has_metadata_csum() ? ext4_dir_ino(pinode) : 0, pinode, peh, offset, buf, len);
+  // if(peh->eh_depth == 0){
+  //   data_block_buff = kmalloc(EXT4_BLOCK_SIZE);
+  //   for(i = 0; i < peh->eh_entries; i++){
+  //     pextent_temp = pextent + i; 
+  //     for(j = 0; j < pextent_temp->ee_len; i++){
+  //       ext4_read_ondisk_block(pextent_temp + j, data_block_buff);    
+  //       todo();
+  //     }
+  //   }
+  //   kfree(data_block_buff);
+  // } else {
+  //   for(i = 0; i < peh->eh_entries; i++){
+  //     /* read the extent header in the next level of the tree */
+  //     peh_next_level = kmalloc(EXT4_BLOCK_SIZE);
+  //     ext4_read_ondisk_block((pextent_idx + i)->ei_leaf_lo, peh_next_level);
+  //     ext4_traverse_extent_tree_recursively(peh_next_level);
+  //     kfree(peh_next_level);
+  //   }
+  // }
+}
+
+/**
+ * Find the extent that maps the logical block lblk of pinode and copy it to pextent.
+ * Return 0 if found, or -1 if lblk is in a hole. ino is the number of pinode,
+ * the checksums of the extent blocks are verified if it is known (not 0).
+ */
+static int ext4_find_extent_ino(__u32 ino, ext4_inode_t *pinode, __u32 lblk, ext4_extent_t *pextent){
+  ext4_extent_header_t *peh = (ext4_extent_header_t *)pinode->i_block;
+  ext4_extent_idx_t *pextent_idx;
+  ext4_extent_t *pextent_temp;
+  void *block_buff = 0;
+  int i, ret = -1;
+
+  assert(pinode->i_flags & EXT4_EXTENTS_FL);
+  while(peh->eh_depth > 0){
+    /* the last index which covers lblk */
+    pextent_idx = (ext4_extent_idx_t *)peh + 1;
+    for(i = 1; i < peh->eh_entries; i++)
+      if(pextent_idx[i].ei_block > lblk)
+        break;
+    if(block_buff == 0)
+      block_buff = bpool_alloc(EXT4_BLOCK_SIZE);
+    ext4_rw_ondisk_block(pextent_idx[i - 1].ei_leaf_lo, block_buff, EXT4_READ);
+    peh = block_buff;
+    assert(peh->eh_magic == EXT4_EH_MAGIC);
+    if(ino)
+      ext4_extent_block_csum_verify(ino, pinode, peh);
+  }
+
+  pextent_temp = (ext4_extent_t *)peh + 1;
+  for(i = 0; i < peh->eh_entries; i++, pextent_temp++){
+    if(lblk >= pextent_temp->ee_block && lblk < pextent_temp->ee_block + EXT4_EXT_LEN(pextent_temp)){
+      *pextent = *pextent_temp;
+      pextent->ee_len = EXT4_EXT_LEN(pextent_temp);
+      ret = 0;
+      break;
+    }
+  }
+  bpool_free(block_buff, EXT4_BLOCK_SIZE);
+  return ret;
+}
+
+/**
+ * The same, for an inode whose number is unknown.
+ */
+int ext4_find_extent(ext4_inode_t *pinode, __u32 lblk, ext4_extent_t *pextent){
+  return ext4_find_extent_ino(0, pinode, lblk, pextent);
+}
+
+/**
+ * Read ahead the data blocks of pextent into the cache before the logical block
+ * lblk in it is read. When a stream enters an extent, the whole physical run is
+ * read ahead (up to EXT4_RA_MAX_BLOCKS). Inside the extent, the window is doubled
+ * each time a sequential stream uses it up, and shrinks to EXT4_RA_MIN_BLOCKS on
+ * a random read; reads smaller than a block do not count again for the same block.
+ * Streams crossing extents are sequential in logical blocks.
+ */
+static void ext4_readahead(struct ext4_ra *ra, ext4_extent_t *pextent, __u32 lblk){
+  __u32 off = lblk - pextent->ee_block;
+  __u32 pblk = pextent->ee_start_lo + off;
+  __u32 left = pextent->ee_len - off;
+  int sequential = ra->window && lblk == ra->next_lblk;
+  __u32 cnt;
+
+  /* another read of the block read last, the stream stays as it is */
+  if(ra->window && lblk + 1 == ra->next_lblk)
+    return;
+  ra->next_lblk = lblk + 1;
+  if(!sequential)
+    ra->window = EXT4_RA_MIN_BLOCKS;
+  if(pblk >= ra->start && pblk < ra->end)
+    return;
+
+  if(sequential && ra->window < EXT4_RA_MAX_BLOCKS)
+    ra->window *= 2;
+  /* entering an extent, read its whole run */
+  cnt = off == 0 ? left : ra->window;
+  if(cnt > left)
+    cnt = left;
+  if(cnt > EXT4_RA_MAX_BLOCKS)
+    cnt = EXT4_RA_MAX_BLOCKS;
+  breadahead(ext4_dev, pblk, cnt);
+  ra->start = pblk;
+  ra->end = pblk + cnt;
+}
+
+static int ext4_da_read(__u32 ino, __u32 lblk, __u32 off, void *buf, int n);
+
+/**
+ * Read len bytes begin with off of the file ino into buf, return the bytes read.
+ * The data blocks are read through the cache, ra keeps the readahead state between
+ * calls of the same stream, it can be 0 if no readahead is wanted. The holes are
+ * read from the delayed blocks, so what ext4_write left there is seen before the
+ * flush; the inode stays locked so that a flush does not move them meanwhile.
+ */
+int ext4_read(__u32 ino, struct ext4_ra *ra, uint64_t off, void *buf, int len){
+  ext4_minode_t *ip = ext4_iget(ino);
+  uint64_t size = ip->d.i_size_lo | ((uint64_t)ip->d.i_size_high << 32);
+  ext4_extent_t extent;
+  int hole = 1, done = 0, n;
+  __u32 lblk, block_off;
+  buf_t *b;
+
+  extent.ee_len = 0;
+  if(off >= size)
+    len = 0;
+  else if(off + len > size)
+    len = size - off;
+
+  while(done < len){
+    lblk = (off + done) >> EXT4_BLOCK_SIZE_BITS;
+    block_off = (off + done) & (EXT4_BLOCK_SIZE - 1);
+    n = EXT4_BLOCK_SIZE - block_off;
+    if(n > len - done)
+      n = len - done;
+
+    /* look up the extent tree only when leaving the last extent */
+    if(extent.ee_len == 0 || lblk < extent.ee_block || lblk >= extent.ee_block + extent.ee_len){
+      hole = ext4_find_extent_ino(ino, &ip->d, lblk, &extent) < 0;
+      if(hole){
+        extent.ee_block = lblk;
+        extent.ee_len = 1;
+      }
+    }
+
+    if(hole){
+      if(!ext4_da_read(ino, lblk, block_off, buf + done, n))
+        memset(buf + done, 0, n);
+    } else {
+      if(ra)
+        ext4_readahead(ra, &extent, lblk);
+      b = bread(ext4_dev, extent.ee_start_lo + lblk - extent.ee_block);
+      memcpy(buf + done, b->data + block_off, n);
+      brelse(b);
+    }
+    done += n;
+  }
+  ext4_iput(ip);
+  return done;
+}
+
+/**
+ * find and set several empty bits on bitmaps of inode and block.
+ */
+int ext4_find_set_bitmap(){
+
+}
+
+
+/*
+ * The block and inode bitmaps of the groups are loaded at the first use and
+ * stay in memory, an allocation only flips bits and marks the bitmap dirty.
+ * The dirty bitmaps are written back together by ext4_bitmap_sync.
+ */
+static struct ext4_bitmap {
+  uint8_t *map[2];  /* indexed by EXT4_BITMAP_*, 0 if not loaded */
+  int dirty[2];
+} *ext4_bitmaps;
+
+/* serializes the loads of the bitmaps, see ext4_get_bitmap */
+static pthread_mutex_t ext4_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The buddy summary of the free blocks of a group, built from its block
+ * bitmap. Bit i of order k is set if the 2^k blocks begin with i << k are
+ * all free. A free chunk of order k is maximal if its parent chunk of order
+ * k + 1 is not free, counters[k] counts them.
+ */
+static struct ext4_buddy {
+  int valid;
+  int largest;      /* the largest order of the maximal free chunks, -1 if none */
+  int orders;       /* the counts of orders, 2^(orders-1) blocks per group at most */
+  __u32 counters[EXT4_MB_ORDERS];
+  uint8_t *map;     /* the bitmaps of all the orders, see ext4_mb_off */
+} *ext4_buddies;
+
+/**
+ * Allocate the per group state for bg_cnts groups, at mount.
+ */
+static void ext4_groups_alloc(){
+  egd = bpool_alloc(bg_cnts * sizeof(ext4_group_desc_t));
+  memset(egd, 0, bg_cnts * sizeof(ext4_group_desc_t));
+  ext4_bitmaps = kmalloc(bg_cnts * sizeof(struct ext4_bitmap));
+  memset(ext4_bitmaps, 0, bg_cnts * sizeof(struct ext4_bitmap));
+  ext4_buddies = kmalloc(bg_cnts * sizeof(struct ext4_buddy));
+  memset(ext4_buddies, 0, bg_cnts * sizeof(struct ext4_buddy));
+  ext4_sb.gdt_dirty = kmalloc(ext4_gdt_blocks());
+  memset(ext4_sb.gdt_dirty, 0, ext4_gdt_blocks());
+  ext4_sb.dirty = 0;
+}
+
+/**
+ * Free the per group state, at umount.
+ */
+static void ext4_groups_free(){
+  bpool_free(egd, bg_cnts * sizeof(ext4_group_desc_t));
+  kfree(ext4_bitmaps);
+  kfree(ext4_buddies);
+  kfree(ext4_sb.gdt_dirty);
+  ext4_sb.gdt_dirty = 0;
+  egd = 0;
+  ext4_bitmaps = 0;
+  ext4_buddies = 0;
+}
+
+/**
+ * The first block of group, bit 0 of its block bitmap.
+ */
+static __u32 ext4_group_first_block(int group){
+  return es.s_first_data_block + group * es.s_blocks_per_group;
+}
+
+/**
+ * The group of block
+ */
+static int ext4_block_group(__u32 block){
+  return (block - es.s_first_data_block) / es.s_blocks_per_group;
+}
+
+/**
+ * The counts of blocks of group, the last group may be shorter.
+ */
+static __u32 ext4_group_nblocks(int group){
+  __u32 left = es.s_blocks_count_lo - ext4_group_first_block(group);
+
+  return left < es.s_blocks_per_group ? left : es.s_blocks_per_group;
+}
+
+/**
+ * Does group hold a backup of the super block and group descriptors?
+ * With sparse_super only the groups 0, 1 and powers of 3, 5, 7 do.
+ */
+static int ext4_group_has_super(int group){
+  int p;
+
+  if(group <= 1 || !(es.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+    return 1;
+  for(p = 3; p <= 7; p += 2){
+    int n = group;
+    while(n % p == 0)
+      n /= p;
+    if(n == 1)
+      return 1;
+  }
+  return 0;
+}
+
+static void ext4_set_bit(uint8_t *bitmap, __u32 i){
+  bitmap[i / 8] |= 1 << (i % 8);
+}
+
+/**
+ * Find free location and set it in given bitmap, return -1 if there is none.
+ */
+static int ext4_get_free_bit(void *bitmap, int upperbound){
+  int i = bitmap_find_zero(bitmap, 0, upperbound);
+
+  if(i >= 0)
+    ((uint8_t *)bitmap)[i / 8] |= 1 << i % 8;
+  return i;
+}
+
+/**
+ * Build the block bitmap of a BLOCK_UNINIT group: only the super block backup,
+ * group descriptors and the metadata blocks (of any group, with flex_bg) in it
+ * are in use, the bits beyond the end of the group are set.
+ */
+static void ext4_init_block_bitmap(int group, uint8_t *bitmap){
+  __u32 first = ext4_group_first_block(group), n = ext4_group_nblocks(group);
+  __u32 itable_blocks = es.s_inodes_per_group * es.s_inode_size / EXT4_BLOCK_SIZE;
+  __u32 i, j, meta[2];
+  int g;
+
+  memset(bitmap, 0, EXT4_BLOCK_SIZE);
+  if(ext4_group_has_super(group)){
+    j = 1 + ext4_gdt_blocks() + es.s_reserved_gdt_blocks;
+    for(i = 0; i < j; i++)
+      ext4_set_bit(bitmap, i);
+  }
+  for(g = 0; g < bg_cnts; g++){
+    meta[0] = egd[g].bg_block_bitmap_lo;
+    meta[1] = egd[g].bg_inode_bitmap_lo;
+    for(i = 0; i < 2; i++)
+      if(meta[i] >= first && meta[i] < first + n)
+        ext4_set_bit(bitmap, meta[i] - first);
+    for(i = egd[g].bg_inode_table_lo; i < egd[g].bg_inode_table_lo + itable_blocks; i++)
+      if(i >= first && i < first + n)
+        ext4_set_bit(bitmap, i - first);
+  }
+  for(i = n; i < EXT4_BLOCK_SIZE * 8; i++)
+    ext4_set_bit(bitmap, i);
+}
+
+/**
+ * The seed of the bitmaps is not changed by the group, the checksum covers
+ * the bits of the group only.
+ */
+static __u32 ext4_bitmap_csum(int type, uint8_t *bitmap){
+  __u32 nbits = type == EXT4_BITMAP_BLOCK ? es.s_blocks_per_group : es.s_inodes_per_group;
+
+  return crc32c(ext4_csum_seed, bitmap, nbits / 8);
+}
+
+/**
+ * The high 16 bits of the bitmap checksums are in the 64 byte descriptors only.
+ */
+static int ext4_bitmap_has_csum_hi(){
+  return ext4_desc_size() >= __builtin_offsetof(ext4_group_desc_t, bg_reserved);
+}
+
+static void ext4_bitmap_csum_set(int group, int type, uint8_t *bitmap){
+  ext4_group_desc_t *gd = &egd[group];
+  __u32 crc;
+
+  if(!ext4_has_metadata_csum())
+    return;
+  crc = ext4_bitmap_csum(type, bitmap);
+  if(type == EXT4_BITMAP_BLOCK){
+    gd->bg_block_bitmap_csum_lo = crc & 0xffff;
+    if(ext4_bitmap_has_csum_hi())
+      gd->bg_block_bitmap_csum_hi = crc >> 16;
+  } else {
+    gd->bg_inode_bitmap_csum_lo = crc & 0xffff;
+    if(ext4_bitmap_has_csum_hi())
+      gd->bg_inode_bitmap_csum_hi = crc >> 16;
+  }
+}
+
+static void ext4_bitmap_csum_verify(int group, int type, uint8_t *bitmap){
+  ext4_group_desc_t *gd = &egd[group];
+  __u32 crc, want;
+
+  if(!ext4_has_metadata_csum())
+    return;
+  crc = ext4_bitmap_csum(type, bitmap);
+  if(type == EXT4_BITMAP_BLOCK)
+    want = gd->bg_block_bitmap_csum_lo | (__u32)gd->bg_block_bitmap_csum_hi << 16;
+  else
+    want = gd->bg_inode_bitmap_csum_lo | (__u32)gd->bg_inode_bitmap_csum_hi << 16;
+  if(!ext4_bitmap_has_csum_hi())
+    crc &= 0xffff;
+  if(crc != want)
+    ext4_csum_bad(type == EXT4_BITMAP_BLOCK ? "block bitmap of group" : "inode bitmap of group", group);
+}
+
+/**
+ * Return the resident block or inode bitmap (type) of group, it is read at the
+ * first use. The bitmap of an uninitialized group is built instead of read.
+ * The scans read the bitmaps without ext4_sb.lock, so a bitmap is loaded
+ * under ext4_bitmap_lock and published only when it is filled.
+ */
+static uint8_t *ext4_get_bitmap(int group, int type){
+  uint8_t **pmap = &ext4_bitmaps[group].map[type];
+  uint8_t *map;
+  __u32 i;
+
+  if((map = __atomic_load_n(pmap, __ATOMIC_ACQUIRE)))
+    return map;
+  pthread_mutex_lock(&ext4_bitmap_lock);
+  /* loaded by another thread meanwhile */
+  if((map = *pmap)){
+    pthread_mutex_unlock(&ext4_bitmap_lock);
+    return map;
+  }
+  map = bpool_alloc(EXT4_BLOCK_SIZE);
+  if(type == EXT4_BITMAP_BLOCK && ext4_has_group_csum() && (egd[group].bg_flags & EXT4_BG_BLOCK_UNINIT)){
+    ext4_init_block_bitmap(group, map);
+  } else if(type == EXT4_BITMAP_INODE && ext4_has_group_csum() && (egd[group].bg_flags & EXT4_BG_INODE_UNINIT)){
+    memset(map, 0, EXT4_BLOCK_SIZE);
+    for(i = es.s_inodes_per_group; i < EXT4_BLOCK_SIZE * 8; i++)
+      ext4_set_bit(map, i);
+  } else {
+    ext4_rw_ondisk_block(type == EXT4_BITMAP_BLOCK ? egd[group].bg_block_bitmap_lo : egd[group].bg_inode_bitmap_lo,
+                         map, EXT4_READ);
+    ext4_bitmap_csum_verify(group, type, map);
+  }
+  __atomic_store_n(pmap, map, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ext4_bitmap_lock);
+  return map;
+}
+
+/**
+ * Mark the bitmap dirty, the group is initialized from now on.
+ * ext4_sb.lock is held.
+ */
+static void ext4_dirty_bitmap(int group, int type){
+  ext4_bitmaps[group].dirty[type] = 1;
+  if(ext4_has_group_csum() && (egd[group].bg_flags & (type == EXT4_BITMAP_BLOCK ? EXT4_BG_BLOCK_UNINIT : EXT4_BG_INODE_UNINIT))){
+    egd[group].bg_flags &= type == EXT4_BITMAP_BLOCK ? ~EXT4_BG_BLOCK_UNINIT : ~EXT4_BG_INODE_UNINIT;
+    ext4_group_dirty(group);
+  }
 }
 
 /**
- * find and set several empty bits on bitmaps of inode and block.
+ * Write back the dirty bitmaps (into the buffer cache), return the counts of them.
+ * Their checksums are kept in the descriptors, which become dirty.
  */
-int ext4_find_set_bitmap(){
+int ext4_bitmap_sync(){
+  int g, type, n = 0;
+
+  pthread_mutex_lock(&ext4_sb.lock);
+  for(g = 0; g < bg_cnts; g++){
+    for(type = 0; type < 2; type++){
+      if(!ext4_bitmaps[g].dirty[type])
+        continue;
+      if(ext4_has_metadata_csum()){
+        ext4_bitmap_csum_set(g, type, ext4_bitmaps[g].map[type]);
+        ext4_group_dirty(g);
+      }
+      ext4_rw_ondisk_block(type == EXT4_BITMAP_BLOCK ? egd[g].bg_block_bitmap_lo : egd[g].bg_inode_bitmap_lo,
+                           ext4_bitmaps[g].map[type], EXT4_WRITE);
+      ext4_bitmaps[g].dirty[type] = 0;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&ext4_sb.lock);
+  return n;
+}
 
+/**
+ * Write back and free all the bitmaps and buddy summaries, at umount.
+ */
+static void ext4_bitmap_drop(){
+  int g, type;
+
+  ext4_bitmap_sync();
+  for(g = 0; g < bg_cnts; g++){
+    for(type = 0; type < 2; type++){
+      bpool_free(ext4_bitmaps[g].map[type], EXT4_BLOCK_SIZE);
+      ext4_bitmaps[g].map[type] = 0;
+    }
+    bpool_free(ext4_buddies[g].map, 2 * EXT4_BLOCK_SIZE);
+    ext4_buddies[g].map = 0;
+    ext4_buddies[g].valid = 0;
+  }
 }
 
 #define UP_FR_IND 0
@@ -353,6 +1755,7 @@ int ext4_find_set_bitmap(){
  * Update the free inode count and the free block count.
  * use type to choose inode or block, use groupid to choose block group,
  * if cnt is negative, the free counts decrese, or it increse.
+ * ext4_sb.lock is held.
  */
 static void ext4_update_free_ib_cnt(int type, int groupid, int cnt){
   if(type == UP_FR_IND){
@@ -364,56 +1767,156 @@ static void ext4_update_free_ib_cnt(int type, int groupid, int cnt){
   } else {
     panic("no such update type");
   }
+  ext4_group_dirty(groupid);
 }
 
 /**
- * Allocate and return an inode number.
- * Note that the inode number is begin from 1.
+ * The counts of free blocks in the super block. da.lock may be held, it is
+ * taken before ext4_sb.lock.
  */
-int ext4_get_inodeno(){
-  int i;
-  void *imap_block_buff;
-  void *itable_block_buff;
-  int inode_no = 0, groupid;
-  int bitmap_blockno;
-
-  /* find a block group that has free inode */
-  for(i = 0; i < bg_cnts; i ++){
-    inode_no = i*es.s_inodes_per_group;
-    if(egd[i].bg_free_inodes_count_lo){
-      /* one group has only one inode bitmap */
-      bitmap_blockno = egd[i].bg_inode_bitmap_lo;
-      groupid = i;
-      break;
-    }
-  } 
+static __u32 ext4_free_blocks(){
+  __u32 n;
 
-  if(i == bg_cnts)
-    panic("no free inodes");
-  
-  imap_block_buff = kmalloc(EXT4_BLOCK_SIZE);
-  ext4_rw_ondisk_block(bitmap_blockno, imap_block_buff, EXT4_READ);
-  for(i = 0; i < es.s_inodes_per_group; i++){
-    // char a = *(char *)(imap_block_buff + i/8);
-    char *a = ((char *)(imap_block_buff) + i/8);
-    if((*a & (1 << (i%8))) == 0){
-      *a |= (1 << (i%8));
-      inode_no += i;
-      break;
+  pthread_mutex_lock(&ext4_sb.lock);
+  n = es.s_free_blocks_count_lo;
+  pthread_mutex_unlock(&ext4_sb.lock);
+  return n;
+}
+
+/**
+ * Return the group of the inode.
+ */
+static int ext4_inode_group(int ino){
+  return (ino - 1) / es.s_inodes_per_group;
+}
+
+/**
+ * Choose a group for a new directory, the orlov allocator of linux:
+ * 1. the subdirectories of the root are spread over the groups, the group with
+ *    the fewest directories among those with the free inodes and free blocks
+ *    above the average is taken, the search starts from a rotating group.
+ * 2. the other directories stay in the group of the parent, unless the group is
+ *    short of free inodes or free blocks, or has too many directories already,
+ *    then the next group that is not is taken.
+ * Return -1 if no group is suitable.
+ */
+static int ext4_find_group_dir(int pgroup, int top){
+  static unsigned rotor;
+  __u32 avefreei = es.s_free_inodes_count / bg_cnts;
+  __u32 avefreeb = es.s_free_blocks_count_lo / bg_cnts;
+  __u32 max_dirs, min_inodes, min_blocks;
+  int i, g, best = -1, start;
+
+  if(top){
+    /* new directories may be made by several threads at once */
+    start = __atomic_fetch_add(&rotor, 1, __ATOMIC_RELAXED) % bg_cnts;
+    for(i = 0; i < bg_cnts; i++){
+      g = (start + i) % bg_cnts;
+      if(egd[g].bg_free_inodes_count_lo < avefreei || egd[g].bg_free_blocks_count_lo < avefreeb)
+        continue;
+      if(best < 0 || egd[g].bg_used_dirs_count_lo < egd[best].bg_used_dirs_count_lo)
+        best = g;
     }
+    if(best >= 0)
+      return best;
+  }
+
+  /* the limits are loosened by a quarter of a group from the averages */
+  max_dirs = ext4_sb.ndirs / bg_cnts + es.s_inodes_per_group / 16;
+  min_inodes = avefreei > es.s_inodes_per_group / 4 ? avefreei - es.s_inodes_per_group / 4 : 1;
+  min_blocks = avefreeb > es.s_blocks_per_group / 4 ? avefreeb - es.s_blocks_per_group / 4 : 1;
+  for(i = 0; i < bg_cnts; i++){
+    g = (pgroup + i) % bg_cnts;
+    if(egd[g].bg_used_dirs_count_lo >= max_dirs)
+      continue;
+    if(egd[g].bg_free_inodes_count_lo < min_inodes || egd[g].bg_free_blocks_count_lo < min_blocks)
+      continue;
+    return g;
+  }
+
+  /* a group with a free inode and the free blocks above the average */
+  for(i = 0; i < bg_cnts; i++){
+    g = (pgroup + i) % bg_cnts;
+    if(egd[g].bg_free_inodes_count_lo && egd[g].bg_free_blocks_count_lo >= avefreeb)
+      return g;
+  }
+  return -1;
+}
+
+/**
+ * Choose a group for a new file, it is kept with its parent:
+ * 1. the group of the parent, if it has a free inode and free blocks.
+ * 2. the groups hashed from the parent group by quadratic probing (the files of
+ *    a full group do not all pour into its neighbour), with both free.
+ * Return -1 if no group is suitable.
+ */
+static int ext4_find_group_other(int pgroup){
+  int i, g;
+
+  if(egd[pgroup].bg_free_inodes_count_lo && egd[pgroup].bg_free_blocks_count_lo)
+    return pgroup;
+  g = pgroup;
+  for(i = 1; i < bg_cnts; i <<= 1){
+    g = (g + i) % bg_cnts;
+    if(egd[g].bg_free_inodes_count_lo && egd[g].bg_free_blocks_count_lo)
+      return g;
+  }
+  return -1;
+}
+
+/**
+ * Allocate and return an inode number for a new inode of mode, whose parent
+ * directory is in pgroup.
+ * Note that the inode number is begin from 1.
+ */
+int ext4_get_inodeno(int pgroup, int mode, int top){
+  int i, idx, groupid = -1;
+  uint8_t *bitmap;
+
+  if(pgroup < 0 || pgroup >= bg_cnts)
+    pgroup = 0;
+  pthread_mutex_lock(&ext4_sb.lock);
+  if(S_ISDIR(mode))
+    groupid = ext4_find_group_dir(pgroup, top);
+  else
+    groupid = ext4_find_group_other(pgroup);
+  /* any block group that has free inode */
+  if(groupid < 0){
+    for(i = 0; i < bg_cnts; i ++)
+      if(egd[(pgroup + i) % bg_cnts].bg_free_inodes_count_lo)
+        break;
+    if(i == bg_cnts)
+      panic("no free inodes");
+    groupid = (pgroup + i) % bg_cnts;
   }
-  ext4_rw_ondisk_block(bitmap_blockno, imap_block_buff, EXT4_WRITE);
+
+  bitmap = ext4_get_bitmap(groupid, EXT4_BITMAP_INODE);
+  idx = ext4_get_free_bit(bitmap, es.s_inodes_per_group);
+  assert(idx >= 0);
+  ext4_dirty_bitmap(groupid, EXT4_BITMAP_INODE);
   ext4_update_free_ib_cnt(UP_FR_IND, groupid, -1);
+  if(S_ISDIR(mode)){
+    egd[groupid].bg_used_dirs_count_lo++;
+    ext4_sb.ndirs++;
+  }
+  /* the inode table of the group is in use up to idx now */
+  if(ext4_has_group_csum() && idx >= es.s_inodes_per_group - egd[groupid].bg_itable_unused_lo)
+    egd[groupid].bg_itable_unused_lo = es.s_inodes_per_group - idx - 1;
+  pthread_mutex_unlock(&ext4_sb.lock);
 
-  kfree(imap_block_buff);
+  ext4_commit_maybe();
 
   /* the inode number begin with 1, not 0, so we need to plus 1 when return */
-  return inode_no + 1;
+  return groupid * es.s_inodes_per_group + idx + 1;
 }
 
 static void ext4_set_new_inode(ext4_inode_t *new_inode, int type){
   ext4_extent_header_t *peh;
 
+  /* the fields not set below are zero, the extra fields fit in struct ext4_inode */
+  memset(new_inode, 0, sizeof(ext4_inode_t));
+  if(es.s_inode_size >= sizeof(ext4_inode_t))
+    new_inode->i_extra_isize = sizeof(ext4_inode_t) - EXT4_GOOD_OLD_INODE_SIZE;
   new_inode->i_mode = S_IRWXO | S_IRWXG | S_IRWXU | type;
   new_inode->i_size_lo = 0;
   new_inode->i_atime = new_inode->i_ctime = new_inode->i_mtime = 0xffffffff;
@@ -432,15 +1935,17 @@ static void ext4_set_new_inode(ext4_inode_t *new_inode, int type){
 
 
 /**
- * Create a new ext4_extent_t on the endest of the header.
+ * Create a new ext4_extent_t at idx of the header, the ones from idx on are
+ * moved back to keep them sorted by ee_block.
  */
-static ext4_extent_t *ext4_create_new_extent(ext4_extent_header_t *peh){
+static ext4_extent_t *ext4_create_new_extent(ext4_extent_header_t *peh, int idx){
   ext4_extent_t *pextent;
 
   if(peh->eh_entries >= peh->eh_max){
     panic("extent full!");
   }
-  pextent = (ext4_extent_t *)(peh) + 1 + peh->eh_entries;
+  pextent = (ext4_extent_t *)(peh) + 1 + idx;
+  memmove(pextent + 1, pextent, (peh->eh_entries - idx) * sizeof(ext4_extent_t));
   pextent->ee_block = 0;
   pextent->ee_len = 0;
   pextent->ee_start_hi = 0;
@@ -462,76 +1967,465 @@ static void ext4_set_extent(ext4_extent_t *pextent, int block, int len, int star
 }
 
 /**
- * Find free location and set it in given bitmap.
+ * The bit offset of the bitmap of order k in the buddy map, there are
+ * 8 * EXT4_BLOCK_SIZE >> k bits of order k.
  */
-static int ext4_get_free_bit(void *bitmap, int upperbound){
-  int i;
-  char *a;
+static __u32 ext4_mb_off(int k){
+  __u32 bits = EXT4_BLOCK_SIZE * 8;
+
+  return 2 * bits - (2 * bits >> k);
+}
+
+static int ext4_mb_test(uint8_t *map, __u32 k, __u32 i){
+  i += ext4_mb_off(k);
+  return map[i / 8] >> (i % 8) & 1;
+}
+
+/**
+ * Is the chunk i of order k free and not part of a free chunk of order k + 1?
+ */
+static int ext4_mb_maximal(struct ext4_buddy *bd, __u32 k, __u32 i){
+  return ext4_mb_test(bd->map, k, i) && (k + 1 == bd->orders || !ext4_mb_test(bd->map, k + 1, i / 2));
+}
+
+/**
+ * Return the buddy summary of group, it is built from the block bitmap at
+ * the first use and kept up to date by ext4_mb_update since.
+ */
+static struct ext4_buddy *ext4_mb_buddy(int group){
+  struct ext4_buddy *bd = &ext4_buddies[group];
+  uint8_t *bitmap;
+  __u32 n, i, k;
+
+  if(bd->valid)
+    return bd;
+  if(bd->map == 0)
+    bd->map = bpool_alloc(2 * EXT4_BLOCK_SIZE);
+  bitmap = ext4_get_bitmap(group, EXT4_BITMAP_BLOCK);
+  n = ext4_group_nblocks(group);
+  memset(bd->map, 0, 2 * EXT4_BLOCK_SIZE);
+  memset(bd->counters, 0, sizeof(bd->counters));
+  for(bd->orders = 1; bd->orders < EXT4_MB_ORDERS && (1U << bd->orders) <= n; bd->orders++)
+    ;
+
+  /* order 0 is the complement of the block bitmap */
+  for(i = 0; i < n / 8; i++)
+    bd->map[i] = ~bitmap[i];
+  for(i = n & ~7; i < n; i++)
+    if(!(bitmap[i / 8] & 1 << i % 8))
+      bd->map[i / 8] |= 1 << i % 8;
+  /* a chunk is free if both of its halves are */
+  for(k = 1; k < bd->orders; k++){
+    for(i = 0; i < n >> k; i++)
+      if(ext4_mb_test(bd->map, k - 1, 2 * i) && ext4_mb_test(bd->map, k - 1, 2 * i + 1))
+        bitmap_set(bd->map, ext4_mb_off(k) + i, 1);
+  }
+
+  bd->largest = -1;
+  for(k = 0; k < bd->orders; k++){
+    for(i = 0; i < n >> k; i++){
+      if(ext4_mb_maximal(bd, k, i)){
+        bd->counters[k]++;
+        bd->largest = k;
+      }
+    }
+  }
+  bd->valid = 1;
+  return bd;
+}
+
+/**
+ * Add sign to the counters of the maximal chunks which may change when the
+ * blocks [off, last] change: the chunks over them of each order and their
+ * buddies, whose parents are over them too.
+ */
+static void ext4_mb_count(struct ext4_buddy *bd, __u32 n, __u32 off, __u32 last, int sign){
+  __u32 k, i, hi;
+
+  for(k = 0; k < bd->orders; k++){
+    hi = (last >> (k + 1) << 1) + 1;
+    if(hi >= n >> k)
+      hi = (n >> k) - 1;
+    for(i = off >> (k + 1) << 1; i <= hi; i++)
+      if(ext4_mb_maximal(bd, k, i))
+        bd->counters[k] += sign;
+  }
+}
+
+/**
+ * Update the buddy summary of group after the cnt blocks begin with off
+ * became free (free = 1) or in use, only the chunks over them are touched.
+ * A summary not built yet is left to be built from the bitmap.
+ */
+static void ext4_mb_update(int group, __u32 off, __u32 cnt, int free){
+  struct ext4_buddy *bd = &ext4_buddies[group];
+  __u32 n = ext4_group_nblocks(group), last = off + cnt - 1, k, i, hi;
+  int j;
+
+  if(!bd->valid || cnt == 0)
+    return;
+  ext4_mb_count(bd, n, off, last, -1);
+  if(free)
+    bitmap_set(bd->map, off, cnt);
+  else
+    bitmap_clear(bd->map, off, cnt);
+  for(k = 1; k < bd->orders; k++){
+    hi = last >> k;
+    if(hi >= n >> k)
+      hi = (n >> k) - 1;
+    for(i = off >> k; i <= hi; i++){
+      if(ext4_mb_test(bd->map, k - 1, 2 * i) && ext4_mb_test(bd->map, k - 1, 2 * i + 1))
+        bitmap_set(bd->map, ext4_mb_off(k) + i, 1);
+      else
+        bitmap_clear(bd->map, ext4_mb_off(k) + i, 1);
+    }
+  }
+  ext4_mb_count(bd, n, off, last, 1);
+
+  bd->largest = -1;
+  for(j = bd->orders - 1; j >= 0 && bd->largest < 0; j--)
+    if(bd->counters[j])
+      bd->largest = j;
+}
+
+/**
+ * Return the first block (in the group) of a maximal free chunk of order k.
+ */
+static __u32 ext4_mb_find_chunk(int group, int k){
+  struct ext4_buddy *bd = ext4_mb_buddy(group);
+  __u32 n = ext4_group_nblocks(group) >> k, i = 0;
+
+  for(;;){
+    i = bitmap_find_one(bd->map, ext4_mb_off(k) + i, ext4_mb_off(k) + n) - ext4_mb_off(k);
+    assert((int)i >= 0);
+    if(k + 1 == bd->orders || !ext4_mb_test(bd->map, k + 1, i / 2))
+      return i << k;
+    i++;
+  }
+}
+
+/**
+ * Mark cnt blocks begin with off of group in use, ext4_sb.lock is held.
+ */
+static void ext4_mb_claim(int group, __u32 off, __u32 cnt){
+  bitmap_set(ext4_get_bitmap(group, EXT4_BITMAP_BLOCK), off, cnt);
+  ext4_mb_update(group, off, cnt, 0);
+  ext4_dirty_bitmap(group, EXT4_BITMAP_BLOCK);
+  ext4_update_free_ib_cnt(UP_FR_BLK, group, -cnt);
+}
 
-  for(i = 0; i < upperbound; i++){
-    a = (char *)bitmap + i/8;
+/**
+ * Mark cnt blocks begin with off of group free.
+ */
+static void ext4_mb_free(int group, __u32 off, __u32 cnt){
+  pthread_mutex_lock(&ext4_sb.lock);
+  bitmap_clear(ext4_get_bitmap(group, EXT4_BITMAP_BLOCK), off, cnt);
+  ext4_mb_update(group, off, cnt, 1);
+  ext4_dirty_bitmap(group, EXT4_BITMAP_BLOCK);
+  ext4_update_free_ib_cnt(UP_FR_BLK, group, cnt);
+  pthread_mutex_unlock(&ext4_sb.lock);
+}
 
-    if((*a & (1 << i%8)) == 0){
-      *a |= (1 << i%8);
-      return i;
+/**
+ * Return the group with the largest free buddy chunk and set *pk to its
+ * order, or return -1 if no block is free. ext4_sb.lock is held.
+ */
+static int ext4_mb_largest(int *pk){
+  struct ext4_buddy *bd;
+  int g, best_g = -1;
+
+  *pk = -1;
+  for(g = 0; g < bg_cnts; g++){
+    if(egd[g].bg_free_blocks_count_lo == 0)
+      continue;
+    bd = ext4_mb_buddy(g);
+    if(bd->largest > *pk){
+      *pk = bd->largest;
+      best_g = g;
     }
   }
+  return best_g;
 }
 
 /**
- * return ONE free block. 
+ * Allocate up to len contiguous free blocks, set *start to the first one and
+ * return the counts of them. need (<= len) is what the caller must have, the
+ * rest is a window it can do without. The policies are tried in order:
+ * 1. goal fit: the run of free blocks begin with goal, so a file grows in place.
+ *    A run shorter than need is taken only if no larger chunk is free elsewhere,
+ *    so the file is not split into more extents than needed.
+ * 2. best fit: the smallest maximal free buddy chunk that holds len blocks,
+ *    the large chunks are kept for large requests.
+ * 3. the first run of len free blocks.
+ * 4. the free run with the largest free chunk, the caller asks again for the rest.
+ * The groups are tried from the group of goal, under ext4_sb.lock.
  */
-static int ext4_get_free_blockno(){
-  int i, blockno = 0;
-  void *blockbitmap_buff;
+static __u32 ext4_mb_alloc(__u32 goal, __u32 len, __u32 need, __u32 *start){
+  int order = 0, g, i, best_g = -1, best_k = EXT4_MB_ORDERS;
+  struct ext4_buddy *bd;
+  uint8_t *bitmap;
+  __u32 off, end, n;
+  int run;
+
+  while((1U << order) < len && order + 1 < EXT4_MB_ORDERS)
+    order++;
+  if(goal < es.s_first_data_block || goal >= es.s_blocks_count_lo)
+    goal = es.s_first_data_block;
+  pthread_mutex_lock(&ext4_sb.lock);
+
+  /* 1. goal fit */
+  g = ext4_block_group(goal);
+  if(egd[g].bg_free_blocks_count_lo > 0){
+    bitmap = ext4_get_bitmap(g, EXT4_BITMAP_BLOCK);
+    off = goal - ext4_group_first_block(g);
+    n = ext4_group_nblocks(g);
+    if(!(bitmap[off / 8] & 1 << off % 8)){
+      end = off + len < n ? off + len : n;
+      run = bitmap_find_one(bitmap, off, end);
+      n = (run < 0 ? end : run) - off;
+      if(n >= need || (ext4_mb_largest(&i) >= 0 && n >= 1U << i)){
+        len = n;
+        goto found;
+      }
+    }
+  }
+
+  /* 2. best fit */
+  for(i = 0; i < bg_cnts && best_k != order; i++){
+    g = (ext4_block_group(goal) + i) % bg_cnts;
+    if(egd[g].bg_free_blocks_count_lo == 0)
+      continue;
+    bd = ext4_mb_buddy(g);
+    for(int k = order; k < bd->orders && k < best_k; k++){
+      if(bd->counters[k]){
+        best_g = g;
+        best_k = k;
+        break;
+      }
+    }
+  }
+  if(best_g >= 0 && (1U << best_k) >= len){
+    g = best_g;
+    off = ext4_mb_find_chunk(g, best_k);
+    goto found;
+  }
 
-  blockbitmap_buff = kmalloc(EXT4_BLOCK_SIZE);
-  /* find a block group that has free blocks */
+  /* 3. first run */
   for(i = 0; i < bg_cnts; i++){
-    blockno = i*es.s_blocks_per_group;
-    if(egd[i].bg_free_blocks_count_lo > 0){
-      ext4_rw_ondisk_block(egd[i].bg_block_bitmap_lo, blockbitmap_buff, EXT4_READ);
-      blockno += ext4_get_free_bit(blockbitmap_buff, es.s_blocks_per_group);
-      ext4_rw_ondisk_block(egd[i].bg_block_bitmap_lo, blockbitmap_buff, EXT4_WRITE);
-      break;
+    g = (ext4_block_group(goal) + i) % bg_cnts;
+    if(egd[g].bg_free_blocks_count_lo < len)
+      continue;
+    bitmap = ext4_get_bitmap(g, EXT4_BITMAP_BLOCK);
+    if((run = bitmap_find_zero_run(bitmap, 0, ext4_group_nblocks(g), len)) >= 0){
+      off = run;
+      goto found;
     }
   }
 
-  ext4_update_free_ib_cnt(UP_FR_BLK, i, -1);
-  kfree(blockbitmap_buff);
-  /* or return blockno + 1? */
-  TODO();
-  return blockno;
+  /* 4. the largest chunk */
+  if((g = ext4_mb_largest(&best_k)) < 0)
+    panic("no free blocks");
+  off = ext4_mb_find_chunk(g, best_k);
+  bitmap = ext4_get_bitmap(g, EXT4_BITMAP_BLOCK);
+  n = ext4_group_nblocks(g);
+  /* the whole free run the chunk is in */
+  while(off > 0 && !(bitmap[(off - 1) / 8] & 1 << (off - 1) % 8))
+    off--;
+  end = off + len < n ? off + len : n;
+  run = bitmap_find_one(bitmap, off, end);
+  len = (run < 0 ? end : run) - off;
+
+found:
+  ext4_mb_claim(g, off, len);
+  pthread_mutex_unlock(&ext4_sb.lock);
+  *start = ext4_group_first_block(g) + off;
+  return len;
 }
 
 /**
  * Check if the bit on bitmap is already assigned.
  */
 int ext4_check_bitmap(int num){
-  int groupid = num / es.s_blocks_per_group;
-  int off = num % es.s_blocks_per_group;
-  void *bitmap_buff = kmalloc(EXT4_BLOCK_SIZE);
+  int groupid = (num - es.s_first_data_block) / es.s_blocks_per_group;
+  int off = (num - es.s_first_data_block) % es.s_blocks_per_group;
+  uint8_t *bitmap = ext4_get_bitmap(groupid, EXT4_BITMAP_BLOCK);
+
+  return (bitmap[off / 8] & 1 << (off % 8));
+}
+
+/**
+ * The goal block of the first data block of inode ino: the data is kept in the
+ * group of the inode, behind its inode table if the table is in the group.
+ */
+static __u32 ext4_inode_goal(int ino){
+  int g = ext4_inode_group(ino);
+  __u32 first = ext4_group_first_block(g);
+  __u32 itable_end = egd[g].bg_inode_table_lo + es.s_inodes_per_group * es.s_inode_size / EXT4_BLOCK_SIZE;
+
+  if(itable_end > first && itable_end < first + ext4_group_nblocks(g))
+    return itable_end;
+  return first;
+}
+
+/*
+ * Preallocation windows. When a file is given new blocks, s_prealloc_blocks
+ * (s_prealloc_dir_blocks for a directory) more blocks behind them are taken
+ * from the allocator too and kept as the window of the inode. The next append
+ * to the file is served from the window, so a file appended in small pieces
+ * goes on in one extent while other files are appended in the same group.
+ * The blocks of a window are in use in the bitmap but not in the file, they
+ * are given back by ext4_pa_discard: at the flush of the file, and for all
+ * the files before the bitmaps are committed (ext4_sync, the periodic commit
+ * and umount), so the bitmaps on the disk never hold a window.
+ */
+struct ext4_pa {
+  __u32 ino;
+  __u32 lblk;                 /* the window maps [lblk, lblk + len) to [pblk, pblk + len) */
+  __u32 pblk;
+  __u32 len;
+  struct ext4_pa *next;
+};
+
+struct {
+  /* protects the list */
+  pthread_mutex_t lock;
+  struct ext4_pa *head;
+} pa = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * The counts of blocks preallocated behind a new run begin with the logical
+ * block lblk of pinode. It is s_prealloc_blocks (s_prealloc_dir_blocks) at
+ * least, mkfs leaves them 0, EXT4_DEFAULT_PREALLOC_BLOCKS is used then. It
+ * grows with the file as far as lblk, up to EXT4_MAX_PREALLOC_SIZE bytes, so
+ * a growing file asks for fewer and larger windows.
+ */
+static __u32 ext4_pa_window(ext4_inode_t *pinode, __u32 lblk){
+  __u32 n = S_ISDIR(pinode->i_mode) ? es.s_prealloc_dir_blocks : es.s_prealloc_blocks;
+  __u32 max = EXT4_MAX_PREALLOC_SIZE >> EXT4_BLOCK_SIZE_BITS;
+
+  if(n == 0)
+    n = EXT4_DEFAULT_PREALLOC_BLOCKS;
+  if(lblk > n)
+    n = lblk < max ? lblk : max;
+  return n;
+}
+
+/**
+ * Unlink the window of ino from the list and return it, pa.lock is held.
+ */
+static struct ext4_pa *ext4_pa_unlink(__u32 ino){
+  struct ext4_pa **pp, *p;
+
+  for(pp = &pa.head; (p = *pp); pp = &p->next){
+    if(p->ino == ino){
+      *pp = p->next;
+      return p;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Take up to cnt blocks for the logical block lblk of ino from its window,
+ * set *start to the first one and return the counts of them. A window which
+ * does not go on at lblk is given back, 0 is returned then.
+ */
+static __u32 ext4_pa_use(__u32 ino, __u32 lblk, __u32 cnt, __u32 *start){
+  struct ext4_pa *p;
+
+  pthread_mutex_lock(&pa.lock);
+  p = ext4_pa_unlink(ino);
+  pthread_mutex_unlock(&pa.lock);
+  if(p == 0)
+    return 0;
+  if(p->lblk != lblk){
+    ext4_mb_free(ext4_block_group(p->pblk), p->pblk - ext4_group_first_block(ext4_block_group(p->pblk)), p->len);
+    kfree(p);
+    return 0;
+  }
+  if(cnt > p->len)
+    cnt = p->len;
+  *start = p->pblk;
+  p->lblk += cnt;
+  p->pblk += cnt;
+  p->len -= cnt;
+  if(p->len == 0){
+    kfree(p);
+    return cnt;
+  }
+  pthread_mutex_lock(&pa.lock);
+  p->next = pa.head;
+  pa.head = p;
+  pthread_mutex_unlock(&pa.lock);
+  return cnt;
+}
+
+/**
+ * Keep the allocated blocks [pblk, pblk + len) as the window of ino for the
+ * logical blocks begin with lblk.
+ */
+static void ext4_pa_add(__u32 ino, __u32 lblk, __u32 pblk, __u32 len){
+  struct ext4_pa *p = kmalloc(sizeof(struct ext4_pa));
+
+  p->ino = ino;
+  p->lblk = lblk;
+  p->pblk = pblk;
+  p->len = len;
+  pthread_mutex_lock(&pa.lock);
+  p->next = pa.head;
+  pa.head = p;
+  pthread_mutex_unlock(&pa.lock);
+}
 
-  ext4_rw_ondisk_block(egd[groupid].bg_block_bitmap_lo, bitmap_buff, EXT4_READ);
-  char *a = (char *)bitmap_buff + off / 8;
+/**
+ * Give back the unused blocks of the window of inode ino, at the last close
+ * of the file or when it is deleted.
+ */
+void ext4_pa_discard(__u32 ino){
+  struct ext4_pa *p;
+
+  pthread_mutex_lock(&pa.lock);
+  p = ext4_pa_unlink(ino);
+  pthread_mutex_unlock(&pa.lock);
+  if(p){
+    ext4_mb_free(ext4_block_group(p->pblk), p->pblk - ext4_group_first_block(ext4_block_group(p->pblk)), p->len);
+    kfree(p);
+  }
+}
 
-  return (*a & 1 << (off % 8));
+/**
+ * Give back the windows of all the inodes, at umount or when the free blocks
+ * run short.
+ */
+static void ext4_pa_discard_all(){
+  __u32 ino;
+
+  for(;;){
+    pthread_mutex_lock(&pa.lock);
+    ino = pa.head ? pa.head->ino : 0;
+    pthread_mutex_unlock(&pa.lock);
+    if(ino == 0)
+      return;
+    ext4_pa_discard(ino);
+  }
 }
 
 /**
- * Allocate and append block_cnt blocks to inode.
- * Find the last struct ext4_extent of pinode extent tree, if
- * 1. there are enough blocks behind the scope of ext4_extent indicates, we just need to modify it's ee_len field.
- * 2. there are not enough blocks, we should allocate the blocks as much as we can, and find one or more new contiguous
- *    areas on disk, than create several new ext4_extent to describe it, and assign these blocks to inode.
+ * Allocate block_cnt blocks to the logical blocks begin with lblk of inode ino,
+ * which must not be mapped yet.
+ * The blocks are taken from the preallocation window of the inode if it goes on
+ * at lblk, otherwise they are asked from ext4_mb_alloc (with a new window behind
+ * them) with the goal where lblk would be if
+ * the extent before it went on (or ext4_inode_goal if there is none), so
+ * 1. if the blocks behind that ext4_extent are free, it is extended.
+ * 2. otherwise the blocks come in as few contiguous areas as the free space allows,
+ *    a new ext4_extent describes each of them.
  */
-void ext4_alloc_block(ext4_inode_t *pinode, int block_cnt){
-  assert(block_cnt == 1);
+static void ext4_alloc_range(int ino, ext4_inode_t *pinode, __u32 lblk, int block_cnt){
   ext4_extent_header_t *peh;
-  ext4_extent_t *pextent;
-  int i, groupid, blockbitmap_blockno;
-  int remain_cnt = block_cnt;
-  void *blockbitmap_buff;
+  ext4_extent_t *pextent = 0;
+  __u32 remain_cnt = block_cnt, goal = ext4_inode_goal(ino), start, cnt, req, want, window;
+  int idx, extend, retried = 0;
 
   peh = (ext4_extent_header_t *)(pinode->i_block);
   assert(peh->eh_magic == EXT4_EH_MAGIC);
@@ -539,33 +2433,426 @@ void ext4_alloc_block(ext4_inode_t *pinode, int block_cnt){
   /* for simplicity, not support extent tree which depth > 0 now */
   assert(peh->eh_depth == 0);
 
-  if(pinode->i_blocks_lo == 0){
-    assert(peh->eh_entries == 0);
-    goto create_new_extent_and_assign_blocks;
-  } else {
-    assert(peh->eh_entries > 0);
-    /* get the last struct ext4_extent */
+  /* the last struct ext4_extent before lblk */
+  for(idx = 0; idx < peh->eh_entries; idx++)
+    if(((ext4_extent_t *)peh)[1 + idx].ee_block > lblk)
+      break;
+  if(idx > 0){
+    pextent = (ext4_extent_t *)peh + idx;
+    assert(pextent->ee_block + pextent->ee_len <= lblk);
+    goal = pextent->ee_start_lo + pextent->ee_len + (lblk - pextent->ee_block - pextent->ee_len);
+  }
+
+  while(remain_cnt > 0){
+    req = remain_cnt < EXT4_INIT_MAX_LEN ? remain_cnt : EXT4_INIT_MAX_LEN;
+    if((cnt = ext4_pa_use(ino, lblk, req, &start)) == 0){
+      window = ext4_pa_window(pinode, lblk);
+      want = req + window <= EXT4_INIT_MAX_LEN ? req + window : req;
+      /* the windows of the others are given back before the space runs out */
+      if(ext4_free_blocks() < want)
+        ext4_pa_discard_all();
+      /* a run at goal that extends pextent adds no extent, any length will do */
+      extend = pextent && pextent->ee_block + pextent->ee_len == lblk &&
+               goal == pextent->ee_start_lo + pextent->ee_len && pextent->ee_len < EXT4_INIT_MAX_LEN;
+      cnt = ext4_mb_alloc(goal, want, extend ? 1 : req, &start);
+      /* or if they break the free space up, then ask again */
+      if(cnt < req && !retried && pa.head){
+        ext4_mb_free(ext4_block_group(start), start - ext4_group_first_block(ext4_block_group(start)), cnt);
+        ext4_pa_discard_all();
+        retried = 1;
+        continue;
+      }
+      /* the blocks behind the request become the window */
+      if(cnt > req){
+        ext4_pa_add(ino, lblk + req, start + req, cnt - req);
+        cnt = req;
+      }
+    }
+    if(pextent && pextent->ee_block + pextent->ee_len == lblk &&
+       start == pextent->ee_start_lo + pextent->ee_len &&
+       pextent->ee_len + cnt <= EXT4_INIT_MAX_LEN){
+      pextent->ee_len += cnt;
+    } else {
+      pextent = ext4_create_new_extent(peh, idx++);
+      ext4_set_extent(pextent, lblk, cnt, start);
+    }
+    lblk += cnt;
+    goal = start + cnt;
+    remain_cnt -= cnt;
+    /* this field of inode refers to sectors on disk, not ext4 block, see reference 2, 4.1 */
+    pinode->i_blocks_lo += (cnt * EXT4_BLOCK2SECTOR_CNT);
+  }
+  ext4_commit_maybe();
+}
+
+/**
+ * Allocate and append block_cnt blocks to inode ino, behind its last extent.
+ */
+void ext4_alloc_block(int ino, ext4_inode_t *pinode, int block_cnt){
+  ext4_extent_header_t *peh = (ext4_extent_header_t *)(pinode->i_block);
+  ext4_extent_t *pextent;
+  __u32 lblk = 0;
+
+  if(peh->eh_entries > 0){
     pextent = (ext4_extent_t *)peh + peh->eh_entries;
-    /* if there are free blocks behind the last ext4_extent */
-    if(!ext4_check_bitmap(pextent->ee_start_lo + pextent->ee_len)){
-      int a = ext4_get_free_blockno();
-      assert(a == pextent->ee_start_lo + pextent->ee_len);
-      pextent->ee_len++;
-      goto success;
+    lblk = pextent->ee_block + pextent->ee_len;
+  }
+  ext4_alloc_range(ino, pinode, lblk, block_cnt);
+}
+
+/*
+ * Delayed allocation. The blocks written to the holes of a file (mostly behind
+ * its end) are kept in memory, only the free block counts are reserved for
+ * them. The physical blocks are chosen at the flush, when the whole dirty range
+ * is known, so each run of delayed blocks is asked from the allocator at once
+ * and comes as one extent if the free space allows. The blocks of a file
+ * dropped before the flush never touch the bitmaps.
+ */
+struct ext4_da_blk {
+  __u32 lblk;
+  void *data;
+};
+
+struct ext4_da {
+  __u32 ino;
+  int n, cap;                 /* the delayed blocks, sorted by lblk */
+  int nruns;                  /* runs of contiguous delayed blocks */
+  struct ext4_da_blk *blks;
+  struct ext4_da *next;
+};
+
+struct {
+  /* protects the list and the blocks of all the files */
+  pthread_mutex_t lock;
+  struct ext4_da *head;
+  __u32 nblocks;              /* delayed blocks of all the files, reserved */
+} da = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Return the delayed blocks of ino, created if create is set, da.lock is held.
+ */
+static struct ext4_da *ext4_da_lookup(__u32 ino, int create){
+  struct ext4_da *d;
+
+  for(d = da.head; d; d = d->next)
+    if(d->ino == ino)
+      return d;
+  if(!create)
+    return 0;
+  d = kmalloc(sizeof(struct ext4_da));
+  memset(d, 0, sizeof(struct ext4_da));
+  d->ino = ino;
+  d->next = da.head;
+  da.head = d;
+  return d;
+}
+
+/**
+ * Unlink d from the list, da.lock is held.
+ */
+static void ext4_da_unlink(struct ext4_da *d){
+  struct ext4_da **pp;
+
+  for(pp = &da.head; *pp; pp = &(*pp)->next){
+    if(*pp == d){
+      *pp = d->next;
+      break;
+    }
+  }
+}
+
+/**
+ * Return the index of the first delayed block of d not below lblk, d->n if
+ * there is none. da.lock is held.
+ */
+static int ext4_da_index(struct ext4_da *d, __u32 lblk){
+  int lo = 0, hi = d->n, mid;
+
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(d->blks[mid].lblk < lblk)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Copy n bytes begin with off of the delayed block lblk of ino into buf,
+ * return 0 if lblk is not delayed.
+ */
+static int ext4_da_read(__u32 ino, __u32 lblk, __u32 off, void *buf, int n){
+  struct ext4_da *d;
+  int i, found = 0;
+
+  pthread_mutex_lock(&da.lock);
+  if((d = ext4_da_lookup(ino, 0))){
+    i = ext4_da_index(d, lblk);
+    if((found = i < d->n && d->blks[i].lblk == lblk))
+      memcpy(buf, d->blks[i].data + off, n);
+  }
+  pthread_mutex_unlock(&da.lock);
+  return found;
+}
+
+/**
+ * Return the data of the delayed block lblk of d, a zeroed block is added if
+ * it is not there. A new block reserves one free block, return 0 if there is
+ * none left, or if it would begin a run and d has maxruns of them already:
+ * each run becomes (at least) one extent at the flush, and the extent tree
+ * of the inode has room for so many more only. da.lock is held.
+ */
+static void *ext4_da_block(struct ext4_da *d, __u32 lblk, int maxruns){
+  int lo = ext4_da_index(d, lblk), joins;
+  struct ext4_da_blk *nblks;
+
+  if(lo < d->n && d->blks[lo].lblk == lblk)
+    return d->blks[lo].data;
+
+  if(da.nblocks >= ext4_free_blocks())
+    return 0;
+  /* the new block joins the runs on either side of it, the runs are cut at the
+    multiples of EXT4_INIT_MAX_LEN, so a long one counts for all its extents */
+  joins = (lo > 0 && d->blks[lo - 1].lblk + 1 == lblk && lblk % EXT4_INIT_MAX_LEN) +
+          (lo < d->n && d->blks[lo].lblk == lblk + 1 && (lblk + 1) % EXT4_INIT_MAX_LEN);
+  if(d->nruns + 1 - joins > maxruns)
+    return 0;
+  d->nruns += 1 - joins;
+  if(d->n == d->cap){
+    d->cap = d->cap ? d->cap * 2 : 16;
+    nblks = kmalloc(d->cap * sizeof(struct ext4_da_blk));
+    memcpy(nblks, d->blks, d->n * sizeof(struct ext4_da_blk));
+    kfree(d->blks);
+    d->blks = nblks;
+  }
+  memmove(d->blks + lo + 1, d->blks + lo, (d->n - lo) * sizeof(struct ext4_da_blk));
+  d->blks[lo].lblk = lblk;
+  d->blks[lo].data = bpool_alloc(EXT4_BLOCK_SIZE);
+  memset(d->blks[lo].data, 0, EXT4_BLOCK_SIZE);
+  d->n++;
+  da.nblocks++;
+  return d->blks[lo].data;
+}
+
+/**
+ * Free the delayed blocks of d and d, the reservation of the blocks not
+ * allocated is given back. da.lock is held.
+ */
+static void ext4_da_free(struct ext4_da *d, int nreserved){
+  int i;
+
+  for(i = 0; i < d->n; i++)
+    bpool_free(d->blks[i].data, EXT4_BLOCK_SIZE);
+  da.nblocks -= nreserved;
+  kfree(d->blks);
+  kfree(d);
+}
+
+/**
+ * Allocate the delayed blocks of the locked inode ip and write them out, each
+ * run of contiguous logical blocks is allocated with one ext4_alloc_range.
+ * Return the counts of the blocks written.
+ */
+static int ext4_da_flush_locked(ext4_minode_t *ip){
+  void *buffs[EXT4_MAX_RW_BLOCKS];
+  ext4_extent_t extent;
+  struct ext4_da *d;
+  int i, j, k, m, x;
+
+  pthread_mutex_lock(&da.lock);
+  if((d = ext4_da_lookup(ip->ino, 0)) == 0){
+    pthread_mutex_unlock(&da.lock);
+    return 0;
+  }
+  ext4_da_unlink(d);
+  pthread_mutex_unlock(&da.lock);
+
+  for(i = 0; i < d->n; i = j){
+    for(j = i + 1; j < d->n && d->blks[j].lblk == d->blks[j - 1].lblk + 1; j++)
+      ;
+    ext4_alloc_range(ip->ino, &ip->d, d->blks[i].lblk, j - i);
+    /* the run may be split into several extents */
+    for(k = i; k < j; k += m){
+      if(ext4_find_extent_ino(ip->ino, &ip->d, d->blks[k].lblk, &extent) < 0)
+        panic("da: delayed block not mapped");
+      m = extent.ee_block + extent.ee_len - d->blks[k].lblk;
+      if(m > j - k)
+        m = j - k;
+      if(m > EXT4_MAX_RW_BLOCKS)
+        m = EXT4_MAX_RW_BLOCKS;
+      for(x = 0; x < m; x++)
+        buffs[x] = d->blks[k + x].data;
+      ext4_rw_ondisk_blocks_vec(extent.ee_start_lo + d->blks[k].lblk - extent.ee_block, m, buffs, EXT4_WRITE);
+    }
+  }
+  ext4_idirty(ip);
+
+  pthread_mutex_lock(&da.lock);
+  i = d->n;
+  ext4_da_free(d, i);
+  pthread_mutex_unlock(&da.lock);
+  return i;
+}
+
+/**
+ * Allocate and write out the delayed blocks of inode ino, and give back the
+ * unused blocks of its window as at the close of the file.
+ * Return the counts of the blocks written.
+ */
+int ext4_da_flush(__u32 ino){
+  ext4_minode_t *ip = ext4_iget(ino);
+  int n = ext4_da_flush_locked(ip);
+
+  ext4_iput(ip);
+  ext4_pa_discard(ino);
+  return n;
+}
+
+/**
+ * Flush the delayed blocks of all the files, return the counts of them.
+ * The windows are kept, the files may go on growing.
+ */
+int ext4_da_sync(){
+  ext4_minode_t *ip;
+  __u32 ino;
+  int n = 0;
+
+  for(;;){
+    pthread_mutex_lock(&da.lock);
+    ino = da.head ? da.head->ino : 0;
+    pthread_mutex_unlock(&da.lock);
+    if(ino == 0)
+      return n;
+    ip = ext4_iget(ino);
+    n += ext4_da_flush_locked(ip);
+    ext4_iput(ip);
+  }
+}
+
+/**
+ * Discard the delayed blocks and the preallocation window of inode ino without
+ * allocating them, for a file being deleted (or truncated to its mapped blocks).
+ */
+void ext4_da_drop(__u32 ino){
+  struct ext4_da *d;
+
+  pthread_mutex_lock(&da.lock);
+  if((d = ext4_da_lookup(ino, 0))){
+    ext4_da_unlink(d);
+    ext4_da_free(d, d->n);
+  }
+  pthread_mutex_unlock(&da.lock);
+  ext4_pa_discard(ino);
+}
+
+/**
+ * Write len bytes of buf to the file ino begin with off, return the bytes
+ * written, or -1 if there is no space.
+ * The blocks already mapped are written through the buffer cache, the others
+ * are delayed (see above) until ext4_da_flush, ext4_da_sync or ext4_umount,
+ * or until more than EXT4_DA_MAX_BLOCKS are delayed. ext4_read sees the
+ * delayed blocks too. The extent tree has depth 0, a write that would need
+ * more extents than it holds stops there, as it does when no space is left.
+ */
+int ext4_write(__u32 ino, uint64_t off, const void *buf, int len){
+  ext4_minode_t *ip = ext4_iget(ino);
+  ext4_extent_header_t *peh = (ext4_extent_header_t *)ip->d.i_block;
+  uint64_t size = ip->d.i_size_lo | ((uint64_t)ip->d.i_size_high << 32);
+  ext4_extent_t extent;
+  struct ext4_da *d = 0;
+  int hole = 1, done = 0, n, flush;
+  __u32 lblk, block_off;
+  void *data;
+  buf_t *b;
+
+  extent.ee_len = 0;
+  while(done < len){
+    lblk = (off + done) >> EXT4_BLOCK_SIZE_BITS;
+    block_off = (off + done) & (EXT4_BLOCK_SIZE - 1);
+    n = EXT4_BLOCK_SIZE - block_off;
+    if(n > len - done)
+      n = len - done;
+
+    /* look up the extent tree only when leaving the last extent */
+    if(extent.ee_len == 0 || lblk < extent.ee_block || lblk >= extent.ee_block + extent.ee_len){
+      hole = ext4_find_extent_ino(ip->ino, &ip->d, lblk, &extent) < 0;
+      if(hole){
+        extent.ee_block = lblk;
+        extent.ee_len = 1;
+      }
+    }
+
+    if(hole){
+      pthread_mutex_lock(&da.lock);
+      if(d == 0)
+        d = ext4_da_lookup(ino, 1);
+      if((data = ext4_da_block(d, lblk, peh->eh_max - peh->eh_entries)))
+        memcpy(data + block_off, buf + done, n);
+      pthread_mutex_unlock(&da.lock);
+      if(data == 0)
+        break;
+    } else {
+      /* a whole block need not to be read first */
+      if(n == EXT4_BLOCK_SIZE)
+        b = bgetblk(ext4_dev, extent.ee_start_lo + lblk - extent.ee_block);
+      else
+        b = bread(ext4_dev, extent.ee_start_lo + lblk - extent.ee_block);
+      memcpy(b->data + block_off, buf + done, n);
+      bwrite(b);
+      brelse(b);
     }
+    done += n;
   }
 
+  if(off + done > size){
+    ip->d.i_size_lo = off + done;
+    ip->d.i_size_high = (off + done) >> 32;
+    ext4_idirty(ip);
+  }
+  pthread_mutex_lock(&da.lock);
+  flush = da.nblocks > EXT4_DA_MAX_BLOCKS;
+  pthread_mutex_unlock(&da.lock);
+  ext4_iput(ip);
+  if(flush)
+    ext4_da_sync();
+  return done == 0 && len > 0 ? -1 : done;
+}
 
-/* Only support create one extent now at once */
-create_new_extent_and_assign_blocks:
-  pextent = ext4_create_new_extent(peh);
-  int blockno = ext4_get_free_blockno();
-  ext4_set_extent(pextent, pinode->i_blocks_lo, block_cnt, blockno);
+/**
+ * Fill st with the summary of the file system, it is read from the totals
+ * kept in memory, nothing is summed up over the groups.
+ */
+void ext4_statfs(struct ext4_statfs *st){
+  __u64 r_blocks = es.s_r_blocks_count_lo;
+
+  st->f_bsize = EXT4_BLOCK_SIZE;
+  st->f_blocks = es.s_blocks_count_lo;
+  pthread_mutex_lock(&da.lock);
+  st->f_bfree = ext4_free_blocks() - da.nblocks;
+  pthread_mutex_unlock(&da.lock);
+  pthread_mutex_lock(&ext4_sb.lock);
+  st->f_files = es.s_inodes_count;
+  st->f_ffree = es.s_free_inodes_count;
+  st->f_dirs = ext4_sb.ndirs;
+  pthread_mutex_unlock(&ext4_sb.lock);
+  st->f_bavail = st->f_bfree > r_blocks ? st->f_bfree - r_blocks : 0;
+}
 
-success:
-  /* this field of inode refers to sectors on disk, not ext4 block, see reference 2, 4.1 */
-  pinode->i_blocks_lo += (block_cnt * EXT4_BLOCK2SECTOR_CNT);
-  return;
+/**
+ * Write everything changed in memory to the disk: the delayed blocks, the
+ * inodes, the bitmaps, the group descriptors and the super block. The windows
+ * are given back first, so the image is clean as after umount.
+ */
+void ext4_sync(){
+  if(bdev_get(ext4_dev)->flags & BDEV_RDONLY)
+    return;
+  ext4_da_sync();
+  ext4_pa_discard_all();
+  ext4_isync();
+  ext4_bitmap_sync();
+  ext4_sb_commit();
+  bsync(ext4_dev);
 }
 
 void ext4_set_dir_entry(ext4_dir_entry_2_t* dir_entry, int inodeno, int rec_len, int dir_type, char *name){
@@ -579,9 +2866,11 @@ void ext4_set_dir_entry(ext4_dir_entry_2_t* dir_entry, int inodeno, int rec_len,
 
 /**
  * Convert new_inode to struct ext4_dir_entry_2 and write it to parent_inode's data block.
+ * The checksum in the tail of the block is patched with the bytes changed.
  */
 void ext4_write_dir_entry(ext4_inode_t *parent_inode, int inodeno, int dir_type, char *name){
-  int block_off = 0, blockno;
+  int block_off = 0, blockno, end;
+  uint8_t old[sizeof(ext4_dir_entry_2_t)];
   ext4_dir_entry_2_t *p_dir_entry;
   void *data_buff;
   ext4_extent_header_t *peh;
@@ -596,20 +2885,29 @@ void ext4_write_dir_entry(ext4_inode_t *parent_inode, int inodeno, int dir_type,
   /* the last data block of parent_inode */
   blockno = pextent->ee_start_lo + pextent->ee_len - 1;
   
-  data_buff = kmalloc(EXT4_BLOCK_SIZE);
+  data_buff = bpool_alloc(EXT4_BLOCK_SIZE);
   ext4_rw_ondisk_block(blockno, data_buff, EXT4_READ);
+  /* the entries end before the tail, if there is one */
+  end = EXT4_BLOCK_SIZE - (ext4_dir_tail(data_buff) ? sizeof(ext4_dir_entry_tail_t) : 0);
   while(1){
+    if(block_off >= end)
+      panic("bad directory block");
     p_dir_entry = (ext4_dir_entry_2_t *)(data_buff + block_off);
     /* The last dir entry in the block */
-    if(p_dir_entry->rec_len + block_off == EXT4_BLOCK_SIZE - 0x0C){
+    if(p_dir_entry->rec_len + block_off == end){
       int len1 = ALIGN(4+2+1+1+p_dir_entry->name_len, 4);
       int len2 = ALIGN(4+2+1+1+strlen(name), 4);
       if(p_dir_entry->rec_len - len1 >= len2){
         int origin = p_dir_entry->rec_len;
+        __le16 old_rec_len = p_dir_entry->rec_len;
         p_dir_entry->rec_len = len1;
+        ext4_dir_csum_patch(data_buff, block_off + __builtin_offsetof(ext4_dir_entry_2_t, rec_len),
+                            &old_rec_len, sizeof(old_rec_len));
         block_off += p_dir_entry->rec_len;
         p_dir_entry = (ext4_dir_entry_2_t *)(data_buff + block_off);
+        memcpy(old, p_dir_entry, 8 + strlen(name));
         ext4_set_dir_entry(p_dir_entry, inodeno, origin-len1, dir_type, name);
+        ext4_dir_csum_patch(data_buff, block_off, old, 8 + strlen(name));
         break;
       } else {
         panic("the block is full!");
@@ -618,7 +2916,7 @@ void ext4_write_dir_entry(ext4_inode_t *parent_inode, int inodeno, int dir_type,
     block_off += p_dir_entry->rec_len;
   }
   ext4_rw_ondisk_block(blockno, data_buff, EXT4_WRITE);
-  kfree(data_buff);
+  bpool_free(data_buff, EXT4_BLOCK_SIZE);
 
 }
 
@@ -635,15 +2933,18 @@ void ext4_generate_dot(){
  */
 ext4_inode_t *ext4_create_inode(ext4_inode_t *parent_inode, int type){
   int new_inodeno;
+  __u32 parent_ino = ext4_dir_ino(parent_inode);
   ext4_inode_t *new_inode;
 
-  new_inodeno = ext4_get_inodeno();
+  /* the new inode is placed by the group of its parent */
+  new_inodeno = ext4_get_inodeno(ext4_inode_group(parent_ino), type,
+                                 S_ISDIR(type) && parent_ino == EXT4_ROOT_DIR_INODE_NUM);
   new_inode = kmalloc(sizeof(ext4_inode_t));
   
   ext4_set_new_inode(new_inode, type);
 
 
-  ext4_alloc_block(new_inode, 1);
+  ext4_alloc_block(new_inodeno, new_inode, 1);
 
   /* the length not include '\0' */
   char *name = "zyy123";
@@ -13,45 +13,904 @@
  * The codes here is to make the ext4 portable to tatakos
  */
 
+#define _GNU_SOURCE
 #include "tatakos.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <assert.h>
 
-struct buf buffer;
+/* devices opened at mount time, indexed by the dev argument of bread/bwrite,
+  fd is -1 if not opened (0 is a valid fd when stdin is closed) */
+struct bdev bdevs[NDEV] = { [0 ... NDEV - 1] = { .fd = -1 } };
 
-const char *fs_img = "/home/zhuyangyang/project/OS/dummy_ext4/ext4_fs.img";
+/*
+ * The buffer cache, buffers are found by hashing (dev, blockno) and recycled
+ * in LRU order. head.next is the most recently used buffer and head.prev the least.
+ * A buffer with refcnt > 0 is pinned and will never be recycled.
+ */
+struct {
+  /* protects the hash chains, the LRU list, refcnt, valid and dirty of the
+    buffers and the dirty counts of the devices. The content of a buffer is
+    protected by its sleep lock. */
+  pthread_mutex_t lock;
+  struct buf *buf;
+  int nbuf;
+  struct buf head;
+  struct buf **hash;
+  int nhash;
+  /* the buffers pinned by the running breadaheads, no more than nbuf / 2 */
+  int ra_pinned;
+} bcache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void initsleeplock(struct sleeplock *lk)
+{
+  pthread_mutex_init(&lk->lk, 0);
+  pthread_cond_init(&lk->cv, 0);
+  lk->locked = 0;
+}
+
+void acquiresleep(struct sleeplock *lk)
+{
+  pthread_mutex_lock(&lk->lk);
+  while(lk->locked)
+    pthread_cond_wait(&lk->cv, &lk->lk);
+  lk->locked = 1;
+  lk->owner = pthread_self();
+  pthread_mutex_unlock(&lk->lk);
+}
+
+/**
+ * Like acquiresleep, but return 0 instead of sleeping if lk is held.
+ */
+int tryacquiresleep(struct sleeplock *lk)
+{
+  int ok;
+
+  pthread_mutex_lock(&lk->lk);
+  ok = !lk->locked;
+  if(ok){
+    lk->locked = 1;
+    lk->owner = pthread_self();
+  }
+  pthread_mutex_unlock(&lk->lk);
+  return ok;
+}
+
+void releasesleep(struct sleeplock *lk)
+{
+  pthread_mutex_lock(&lk->lk);
+  lk->locked = 0;
+  pthread_cond_broadcast(&lk->cv);
+  pthread_mutex_unlock(&lk->lk);
+}
+
+/**
+ * Is lk held by the calling thread?
+ */
+int holdingsleep(struct sleeplock *lk)
+{
+  int r;
+
+  pthread_mutex_lock(&lk->lk);
+  r = lk->locked && pthread_equal(lk->owner, pthread_self());
+  pthread_mutex_unlock(&lk->lk);
+  return r;
+}
+
+/**
+ * Allocate the buffer cache with nbuf buffers, 0 means NBUF.
+ * Must be called before any device is opened, or it is called with NBUF
+ * when the first device is opened.
+ */
+void binit(int nbuf)
+{
+  struct buf *b;
+
+  assert(bcache.buf == 0);
+  if(nbuf <= 0)
+    nbuf = NBUF;
+
+  bcache.nbuf = nbuf;
+  bcache.buf = calloc(nbuf, sizeof(struct buf));
+  bcache.nhash = nbuf;
+  bcache.hash = calloc(bcache.nhash, sizeof(struct buf *));
+  if(bcache.buf == 0 || bcache.hash == 0)
+    panic("binit: out of memory");
+
+  bcache.head.prev = &bcache.head;
+  bcache.head.next = &bcache.head;
+  for(b = bcache.buf; b < bcache.buf + nbuf; b++){
+    initsleeplock(&b->lock);
+    b->next = bcache.head.next;
+    b->prev = &bcache.head;
+    bcache.head.next->prev = b;
+    bcache.head.next = b;
+  }
+}
+
+static inline struct buf **bhash(uint32_t dev, uint32_t blockno)
+{
+  return &bcache.hash[(blockno ^ (dev << 24)) % bcache.nhash];
+}
+
+static void bunhash(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = bhash(b->dev, b->blockno); *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      break;
+    }
+  }
+  b->hnext = 0;
+}
+
+/**
+ * Find the cached buffer of (dev, blockno) without touching its refcnt,
+ * bcache.lock must be held.
+ */
+static struct buf *blookup(uint32_t dev, uint32_t blockno)
+{
+  struct buf *b;
+
+  for(b = *bhash(dev, blockno); b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+/*
+ * The pool of BPOOL_ALIGN aligned buffers, freed buffers are kept for reuse.
+ * Buffers given to an O_DIRECT device must come from it.
+ */
+static struct {
+  pthread_mutex_t lock;
+  int n;
+  struct {
+    uint32_t size;
+    void *p;
+  } free[BPOOL_MAX];
+} bpool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Allocate an aligned buffer of size bytes, free it with bpool_free.
+ */
+void *bpool_alloc(uint32_t size)
+{
+  void *p;
+  int i;
+
+  pthread_mutex_lock(&bpool.lock);
+  for(i = bpool.n - 1; i >= 0; i--){
+    if(bpool.free[i].size == size){
+      p = bpool.free[i].p;
+      bpool.free[i] = bpool.free[--bpool.n];
+      pthread_mutex_unlock(&bpool.lock);
+      return p;
+    }
+  }
+  pthread_mutex_unlock(&bpool.lock);
+  if(posix_memalign(&p, BPOOL_ALIGN, size) != 0)
+    panic("bpool: out of memory");
+  return p;
+}
+
+void bpool_free(void *p, uint32_t size)
+{
+  if(p == 0)
+    return;
+  pthread_mutex_lock(&bpool.lock);
+  if(bpool.n == BPOOL_MAX){
+    pthread_mutex_unlock(&bpool.lock);
+    kfree(p);
+    return;
+  }
+  bpool.free[bpool.n].size = size;
+  bpool.free[bpool.n].p = p;
+  bpool.n++;
+  pthread_mutex_unlock(&bpool.lock);
+}
+
+/**
+ * Can the io of iov at off be done on bd without a bounce buffer?
+ */
+static int bdev_aligned(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off)
+{
+  int i;
+
+  if(off % bd->align)
+    return 0;
+  for(i = 0; i < iovcnt; i++)
+    if((uintptr_t)iov[i].iov_base % bd->align || iov[i].iov_len % bd->align)
+      return 0;
+  return 1;
+}
+
+/**
+ * preadv/pwritev on bd. O_DIRECT requires the offset, the length and the memory
+ * to be aligned to the logical sector size, if they are not, the io is rounded
+ * out to the sectors covering it and goes through an aligned bounce buffer
+ * (read-modify-write for a write). A read-modify-write rewrites the bytes of
+ * the sectors beyond the io, so it excludes the other writes of bd.
+ */
+static ssize_t bdev_rwv(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off, int write)
+{
+  off_t start, end;
+  ssize_t len = 0, n;
+  uint8_t *bounce, *p;
+  int i, rmw;
+
+  if(!(bd->flags & BDEV_DIRECT))
+    return write ? pwritev(bd->fd, iov, iovcnt, off) : preadv(bd->fd, iov, iovcnt, off);
+  if(bdev_aligned(bd, iov, iovcnt, off)){
+    if(!write)
+      return preadv(bd->fd, iov, iovcnt, off);
+    pthread_rwlock_rdlock(&bd->rmw_lock);
+    n = pwritev(bd->fd, iov, iovcnt, off);
+    pthread_rwlock_unlock(&bd->rmw_lock);
+    return n;
+  }
+
+  for(i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  start = off / bd->align * bd->align;
+  end = ALIGN(off + len, (off_t)bd->align);
+  bounce = bpool_alloc(end - start);
+  /* only the memory is unaligned, the sectors are overwritten as a whole */
+  rmw = write && (start != off || end != off + len);
+  if(rmw)
+    pthread_rwlock_wrlock(&bd->rmw_lock);
+  else if(write)
+    pthread_rwlock_rdlock(&bd->rmw_lock);
+
+  if(!write || rmw){
+    n = pread(bd->fd, bounce, end - start, start);
+    if(n < off + len - start)
+      goto out;
+  }
+  p = bounce + (off - start);
+  for(i = 0; i < iovcnt; i++){
+    if(write)
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    else
+      memcpy(iov[i].iov_base, p, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  n = len;
+  if(write && pwrite(bd->fd, bounce, end - start, start) != end - start)
+    n = -1;
+out:
+  if(write)
+    pthread_rwlock_unlock(&bd->rmw_lock);
+  bpool_free(bounce, end - start);
+  return n;
+}
+
+ssize_t bdev_preadv(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off)
+{
+  return bdev_rwv(bd, iov, iovcnt, off, 0);
+}
+
+ssize_t bdev_pwritev(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off)
+{
+  return bdev_rwv(bd, iov, iovcnt, off, 1);
+}
+
+/**
+ * Is the io of iov at off on bd fine for an asynchronous engine?
+ */
+int bdev_can_async(struct bdev *bd, const struct iovec *iov, int iovcnt, off_t off)
+{
+  return !(bd->flags & BDEV_DIRECT) || bdev_aligned(bd, iov, iovcnt, off);
+}
+
+/**
+ * The alignment O_DIRECT needs on fd: the logical sector size of a block
+ * device, or what the file system the image lives in reports (statx), 512
+ * if it does not tell. Return 0 if it can not do O_DIRECT at all.
+ */
+static uint32_t bdev_direct_align(int fd)
+{
+  struct stat st;
+  int ssz;
+
+  if(fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &ssz) == 0)
+    return ssz;
+#ifdef STATX_DIOALIGN
+  {
+    struct statx stx;
+
+    if(statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)){
+      if(stx.stx_dio_offset_align == 0)
+        return 0;
+      return stx.stx_dio_offset_align > stx.stx_dio_mem_align ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+    }
+  }
+#endif
+  return 512;
+}
+
+/**
+ * Open the image (or block device) at path as device dev.
+ * The fd is kept until bdev_close, so bread/bwrite never reopen it.
+ */
+int bdev_open(uint32_t dev, const char *path, int flags)
+{
+  struct bdev *bd;
+  int fd;
+
+  if(dev >= NDEV)
+    return -1;
+  bd = &bdevs[dev];
+  assert(bd->fd < 0);
+
+  if(bcache.buf == 0)
+    binit(NBUF);
+
+  if(flags & BDEV_MMAP)
+    flags |= BDEV_RDONLY;
+
+  fd = open(path, ((flags & BDEV_RDONLY) ? O_RDONLY : O_RDWR) | ((flags & BDEV_DIRECT) ? O_DIRECT : 0));
+  if(fd < 0){
+    perror(path);
+    return -1;
+  }
+  bd->align = 1;
+  if(flags & BDEV_DIRECT){
+    bd->align = bdev_direct_align(fd);
+    /* the pool can not align buffers for it, go through the page cache */
+    if(bd->align == 0 || bd->align > BPOOL_ALIGN){
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      flags &= ~BDEV_DIRECT;
+      bd->align = 1;
+    }
+  }
+  pthread_rwlock_init(&bd->rmw_lock, 0);
+  bd->map = 0;
+  bd->size = 0;
+  if(flags & BDEV_MMAP){
+    struct stat st;
+
+    if(fstat(fd, &st) < 0 || st.st_size == 0){
+      close(fd);
+      return -1;
+    }
+    bd->size = st.st_size;
+    bd->map = mmap(0, bd->size, PROT_READ, MAP_SHARED, fd, 0);
+    if(bd->map == MAP_FAILED){
+      perror(path);
+      close(fd);
+      bd->map = 0;
+      return -1;
+    }
+  }
+  bd->fd = fd;
+  bd->flags = flags;
+  bd->path = path;
+  bd->bsize = SECTOR_SIZE;
+  bd->ndirty = 0;
+  bd->last_sync = time(0);
+  return 0;
+}
+
+/**
+ * Return the address of cnt blocks begin with blockno in the mapped image,
+ * or 0 if dev is not opened with BDEV_MMAP. No copy is made, the blocks are
+ * read only.
+ */
+void *bmap(uint32_t dev, uint64_t blockno, uint32_t cnt)
+{
+  struct bdev *bd = bdev_get(dev);
+
+  if(bd->map == 0)
+    return 0;
+  if((blockno + cnt) * bd->bsize > bd->size)
+    panic("bmap: beyond the end of device");
+  return bd->map + blockno*bd->bsize;
+}
+
+/**
+ * Drop all the cached buffers of dev, they should be clean and not pinned.
+ */
+static void binval(uint32_t dev)
+{
+  struct buf *b;
+
+  pthread_mutex_lock(&bcache.lock);
+  for(b = bcache.buf; b < bcache.buf + bcache.nbuf; b++){
+    if(b->dev != dev || blookup(dev, b->blockno) != b)
+      continue;
+    assert(b->refcnt == 0 && !b->dirty);
+    bunhash(b);
+    b->valid = 0;
+  }
+  pthread_mutex_unlock(&bcache.lock);
+}
+
+void bdev_close(uint32_t dev)
+{
+  struct bdev *bd = bdev_get(dev);
+
+  bsync(dev);
+  binval(dev);
+  if(bd->map)
+    munmap(bd->map, bd->size);
+  bd->map = 0;
+  close(bd->fd);
+  pthread_rwlock_destroy(&bd->rmw_lock);
+  bd->fd = -1;
+  bd->path = 0;
+}
+
+/**
+ * Return the opened device dev, panic if it is not opened.
+ */
+struct bdev *bdev_get(uint32_t dev)
+{
+  if(dev >= NDEV || bdevs[dev].fd < 0)
+    panic("bdev: device not opened");
+  return &bdevs[dev];
+}
 
 /**
- * The block here refers to sector.
+ * Change the unit of blockno used by bread/breadv on dev, e.g. to
+ * the block size of the file system mounted on it.
  */
-struct buf* bread(uint32_t dev, uint32_t sectorno)
+void bdev_set_bsize(uint32_t dev, uint32_t bsize)
 {
-  struct buf *b = &buffer;
+  struct bdev *bd = bdev_get(dev);
 
-  int fd = open(fs_img, O_RDWR);
+  assert(bsize % SECTOR_SIZE == 0);
+  bsync(dev);
+  binval(dev);
+  bd->bsize = bsize;
+}
 
-  /* if at the end of the file, will it report ? */
-  lseek(fd, sectorno*SECTOR_SIZE, SEEK_SET);
+/* a dirty buffer to write back, and whether bwrite_dirty locked it */
+struct bdirty {
+  struct buf *b;
+  int locked;
+};
 
-  read(fd, b->data, SECTOR_SIZE);
+static int bcmp_blockno(const void *a, const void *b)
+{
+  uint32_t x = ((struct bdirty *)a)->b->blockno, y = ((struct bdirty *)b)->b->blockno;
 
-  close(fd);
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Unpin b without touching the LRU list, bcache.lock must be held.
+ */
+static void bunpin(struct buf *b)
+{
+  assert(b->refcnt > 0);
+  b->refcnt--;
+}
+
+/**
+ * Write back the dirty buffers of dev in the order of blockno (elevator),
+ * the buffers of adjacent blocks are merged into one pwritev.
+ * A buffer locked by another thread is being changed, it is left dirty,
+ * a buffer locked by the calling thread is written.
+ * Return the counts of blocks written.
+ */
+static int bwrite_dirty(uint32_t dev)
+{
+  struct bdev *bd = bdev_get(dev);
+  struct bdirty *dirty;
+  struct buf *b;
+  struct iovec iov[BWRITE_IOV_MAX];
+  int i, j, n = 0, m = 0;
+  ssize_t len;
+
+  pthread_mutex_lock(&bcache.lock);
+  if(bd->ndirty == 0){
+    pthread_mutex_unlock(&bcache.lock);
+    return 0;
+  }
+  if(bd->flags & BDEV_RDONLY)
+    panic("bwrite: read only device");
+  dirty = kmalloc(bcache.nbuf * sizeof(struct bdirty));
+  for(b = bcache.buf; b < bcache.buf + bcache.nbuf; b++){
+    if(b->dev == dev && b->dirty){
+      /* pin it, so it will not be recycled */
+      b->refcnt++;
+      dirty[n].b = b;
+      dirty[n++].locked = 0;
+    }
+  }
+  pthread_mutex_unlock(&bcache.lock);
+
+  for(i = 0; i < n; i++){
+    b = dirty[i].b;
+    if(holdingsleep(&b->lock))
+      continue;
+    if(tryacquiresleep(&b->lock)){
+      dirty[i].locked = 1;
+      continue;
+    }
+    /* busy, leave it to the next flush */
+    pthread_mutex_lock(&bcache.lock);
+    bunpin(b);
+    pthread_mutex_unlock(&bcache.lock);
+    dirty[i].b = 0;
+  }
+  for(i = 0; i < n; i++)
+    if(dirty[i].b)
+      dirty[m++] = dirty[i];
+  n = m;
+  qsort(dirty, n, sizeof(struct bdirty), bcmp_blockno);
+
+  for(i = 0; i < n; i = j){
+    len = 0;
+    for(j = i; j < n && j - i < BWRITE_IOV_MAX; j++){
+      if(j > i && dirty[j].b->blockno != dirty[j-1].b->blockno + 1)
+        break;
+      iov[j-i].iov_base = dirty[j].b->data;
+      iov[j-i].iov_len = bd->bsize;
+      len += bd->bsize;
+    }
+    if(bdev_pwritev(bd, iov, j - i, (off_t)dirty[i].b->blockno*bd->bsize) != len)
+      panic("bwrite: short write");
+  }
+
+  pthread_mutex_lock(&bcache.lock);
+  for(i = 0; i < n; i++){
+    if(dirty[i].b->dirty){
+      dirty[i].b->dirty = 0;
+      bd->ndirty--;
+    }
+    bunpin(dirty[i].b);
+  }
+  pthread_mutex_unlock(&bcache.lock);
+  for(i = 0; i < n; i++)
+    if(dirty[i].locked)
+      releasesleep(&dirty[i].b->lock);
+
+  kfree(dirty);
+  return n;
+}
+
+/**
+ * Recycle the least recently used unpinned clean buffer for (dev, blockno),
+ * it is returned pinned and locked. Return 0 if all the unpinned buffers are
+ * dirty, *dirty_dev is set to the device of one of them.
+ * bcache.lock must be held.
+ */
+static struct buf *brecycle(uint32_t dev, uint32_t blockno, int *dirty_dev)
+{
+  struct bdev *bd = bdev_get(dev);
+  struct buf *b;
+
+  *dirty_dev = -1;
+  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
+    if(b->refcnt != 0)
+      continue;
+    if(b->dirty){
+      *dirty_dev = b->dev;
+      continue;
+    }
+    if(blookup(b->dev, b->blockno) == b)
+      bunhash(b);
+    if(b->size != bd->bsize){
+      bpool_free(b->data, b->size);
+      b->data = bpool_alloc(bd->bsize);
+      b->size = bd->bsize;
+    }
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->dirty = 0;
+    b->refcnt = 1;
+    b->hnext = *bhash(dev, blockno);
+    *bhash(dev, blockno) = b;
+    /* nobody holds an unpinned buffer, it does not sleep */
+    acquiresleep(&b->lock);
+    return b;
+  }
+  return 0;
+}
+
+/**
+ * Look through the cache for (dev, blockno), if not found, recycle the least
+ * recently used unpinned buffer. Either way return a pinned and locked buffer.
+ * If new is set, return 0 when the block is already cached or every buffer
+ * is pinned.
+ */
+static struct buf *bget_new(uint32_t dev, uint32_t blockno, int new)
+{
+  struct buf *b;
+  int dirty_dev;
+
+  for(;;){
+    pthread_mutex_lock(&bcache.lock);
+    b = blookup(dev, blockno);
+    if(b){
+      if(new){
+        pthread_mutex_unlock(&bcache.lock);
+        return 0;
+      }
+      b->refcnt++;
+      pthread_mutex_unlock(&bcache.lock);
+      acquiresleep(&b->lock);
+      return b;
+    }
+
+    b = brecycle(dev, blockno, &dirty_dev);
+    pthread_mutex_unlock(&bcache.lock);
+    if(b)
+      return b;
+    /* a readahead just goes without the block */
+    if(dirty_dev < 0 && new)
+      return 0;
+    if(dirty_dev < 0)
+      panic("bget: no buffers");
+    /* write back on eviction, together with the other dirty buffers of the device */
+    bwrite_dirty(dirty_dev);
+  }
+}
+
+static struct buf *bget(uint32_t dev, uint32_t blockno)
+{
+  return bget_new(dev, blockno, 0);
+}
+
+/**
+ * Return a locked buffer with the content of block blockno,
+ * the unit of blockno is the block size of dev (sector by default).
+ * Call brelse when done with it.
+ */
+struct buf* bread(uint32_t dev, uint32_t blockno)
+{
+  struct bdev *bd = bdev_get(dev);
+  struct buf *b = bget(dev, blockno);
+
+  if(!b->valid && bd->map){
+    memcpy(b->data, bmap(dev, blockno, 1), bd->bsize);
+    b->valid = 1;
+  }
+  if(!b->valid){
+    /* reading beyond the end of the image returns 0 bytes, treat it as an error */
+    struct iovec iov = { .iov_base = b->data, .iov_len = bd->bsize };
+
+    if(bdev_preadv(bd, &iov, 1, (off_t)blockno*bd->bsize) != bd->bsize)
+      panic("bread: short read");
+    b->valid = 1;
+  }
 
   return b;
 }
 
+/**
+ * Like bread, but do not read the disk if the block is not cached,
+ * used when the caller is going to overwrite the whole block.
+ */
+struct buf* bgetblk(uint32_t dev, uint32_t blockno)
+{
+  return bget(dev, blockno);
+}
 
+/**
+ * Mark the buffer dirty, it is written back by bsync or when it is evicted.
+ * Dirty buffers are collected until BSYNC_INTERVAL seconds passed since the
+ * last bsync or half of the cache is dirty, then they are synced together.
+ */
 void bwrite(struct buf *b){
-  int fd = open(fs_img, O_RDWR);
+  struct bdev *bd = bdev_get(b->dev);
+  int sync;
+
+  assert(holdingsleep(&b->lock));
+  if(bd->flags & BDEV_RDONLY)
+    panic("bwrite: read only device");
+  pthread_mutex_lock(&bcache.lock);
+  b->valid = 1;
+  if(!b->dirty){
+    b->dirty = 1;
+    bd->ndirty++;
+  }
+  sync = bd->ndirty >= bcache.nbuf / 2 || time(0) - bd->last_sync >= BSYNC_INTERVAL;
+  pthread_mutex_unlock(&bcache.lock);
+  if(sync)
+    bsync(b->dev);
+}
+
+/**
+ * Unlock and unpin the buffer and move it to the head of the LRU list.
+ */
+void brelse(struct buf *b)
+{
+  assert(holdingsleep(&b->lock));
+  releasesleep(&b->lock);
+
+  pthread_mutex_lock(&bcache.lock);
+  assert(b->refcnt > 0);
+  if(--b->refcnt == 0){
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+    b->next = bcache.head.next;
+    b->prev = &bcache.head;
+    bcache.head.next->prev = b;
+    bcache.head.next = b;
+  }
+  pthread_mutex_unlock(&bcache.lock);
+}
+
+/**
+ * Write back all the dirty buffers of dev, followed by one fdatasync.
+ */
+void bsync(uint32_t dev)
+{
+  struct bdev *bd = bdev_get(dev);
+
+  if(bwrite_dirty(dev) && fdatasync(bd->fd) < 0)
+    panic("bsync: fdatasync failed");
+  pthread_mutex_lock(&bcache.lock);
+  bd->last_sync = time(0);
+  pthread_mutex_unlock(&bcache.lock);
+}
 
-  assert(b->blockno != 0);
-  lseek(fd, b->blockno*SECTOR_SIZE, SEEK_SET);
+/**
+ * Keep the cache coherent with cnt blocks begin with blockno which were
+ * transferred bypassing it: after a read, data gets the (maybe dirty)
+ * content of the cached blocks, after a write the cached blocks get data.
+ */
+void bcoherent(uint32_t dev, uint64_t blockno, void *data, uint32_t cnt, int write)
+{
+  struct bdev *bd = bdev_get(dev);
+  struct buf *b;
+  uint32_t j;
+  int held;
+
+  for(j = 0; j < cnt; j++){
+    pthread_mutex_lock(&bcache.lock);
+    b = blookup(dev, blockno + j);
+    if(b == 0 || !b->valid){
+      pthread_mutex_unlock(&bcache.lock);
+      continue;
+    }
+    b->refcnt++;
+    pthread_mutex_unlock(&bcache.lock);
 
-  write(fd, b->data, SECTOR_SIZE);
+    held = holdingsleep(&b->lock);
+    if(!held)
+      acquiresleep(&b->lock);
+    if(write){
+      memcpy(b->data, data + j*bd->bsize, bd->bsize);
+    } else if(b->valid){
+      memcpy(data + j*bd->bsize, b->data, bd->bsize);
+    }
+    pthread_mutex_lock(&bcache.lock);
+    if(write && b->dirty){
+      b->dirty = 0;
+      bd->ndirty--;
+    }
+    bunpin(b);
+    pthread_mutex_unlock(&bcache.lock);
+    if(!held)
+      releasesleep(&b->lock);
+  }
+}
+
+/**
+ * Bring cnt blocks begin with blockno into the cache, the blocks which are
+ * not cached yet are read with one batch, contiguous ones with one request.
+ * It does nothing for a mapped device. All the readaheads running together
+ * never pin more than half of the cache, a readahead is cut short instead.
+ */
+void breadahead(uint32_t dev, uint64_t blockno, uint32_t cnt)
+{
+  struct bdev *bd = bdev_get(dev);
+  struct bio_batch batch;
+  struct iovec iov[BRA_MAX];
+  struct buf *bufs[BRA_MAX];
+  struct buf *b;
+  uint32_t i, n = 0, start = 0;
+
+  if(bd->map)
+    return;
+  if(cnt > BRA_MAX)
+    cnt = BRA_MAX;
+  pthread_mutex_lock(&bcache.lock);
+  if(cnt > bcache.nbuf / 2 - bcache.ra_pinned)
+    cnt = bcache.nbuf / 2 - bcache.ra_pinned;
+  bcache.ra_pinned += cnt;
+  pthread_mutex_unlock(&bcache.lock);
+  if(cnt == 0)
+    return;
+
+  bio_batch_init(&batch);
+  for(i = 0; i <= cnt; i++){
+    /* a block already cached (or being read by others) ends the run */
+    b = i < cnt ? bget_new(dev, blockno + i, 1) : 0;
+    if(b == 0 && n > start){
+      bio_batch_addv(&batch, dev, bufs[start]->blockno, iov + start, n - start);
+      start = n;
+      if(batch.nreq == BIO_BATCH_MAX)
+        break;
+    }
+    if(b == 0)
+      continue;
+    bufs[n] = b;
+    iov[n].iov_base = b->data;
+    iov[n].iov_len = bd->bsize;
+    n++;
+  }
+  bio_batch_wait(&batch);
+
+  pthread_mutex_lock(&bcache.lock);
+  for(i = 0; i < start; i++)
+    bufs[i]->valid = 1;
+  pthread_mutex_unlock(&bcache.lock);
+  /* and the blocks left by a full batch, they are read when used */
+  for(i = 0; i < n; i++)
+    brelse(bufs[i]);
+  pthread_mutex_lock(&bcache.lock);
+  bcache.ra_pinned -= cnt;
+  pthread_mutex_unlock(&bcache.lock);
+}
 
-  close(fd);
+/**
+ * Read or write the blocks begin with blockno into (from) the iovecs in
+ * one preadv/pwritev, bypassing the cache. The length of every iovec must be
+ * multiple of the block size of dev. Cached blocks in the range are kept
+ * coherent: a read sees their (maybe dirty) content and a write updates them.
+ */
+static void brwv(uint32_t dev, uint64_t blockno, const struct iovec *iov, int iovcnt, int write)
+{
+  struct bdev *bd = bdev_get(dev);
+  off_t off = (off_t)blockno*bd->bsize;
+  ssize_t len = 0, n;
+  int i;
+
+  for(i = 0; i < iovcnt; i++){
+    assert(iov[i].iov_len % bd->bsize == 0);
+    len += iov[i].iov_len;
+  }
+
+  if(write){
+    if(bd->flags & BDEV_RDONLY)
+      panic("bwritev: read only device");
+    n = bdev_pwritev(bd, iov, iovcnt, off);
+  } else if(bd->map){
+    uint8_t *p = bmap(dev, blockno, len / bd->bsize);
+    for(i = 0; i < iovcnt; i++){
+      memcpy(iov[i].iov_base, p, iov[i].iov_len);
+      p += iov[i].iov_len;
+    }
+    /* a mapped device is read only, there is nothing in the cache newer than it */
+    return;
+  } else {
+    n = bdev_preadv(bd, iov, iovcnt, off);
+  }
+  if(n != len)
+    panic(write ? "bwritev: short write" : "breadv: short read");
+
+  for(i = 0; i < iovcnt; i++){
+    bcoherent(dev, blockno, iov[i].iov_base, iov[i].iov_len / bd->bsize, write);
+    blockno += iov[i].iov_len / bd->bsize;
+  }
+}
+
+void breadv(uint32_t dev, uint64_t blockno, const struct iovec *iov, int iovcnt)
+{
+  brwv(dev, blockno, iov, iovcnt, 0);
+}
+
+void bwritev(uint32_t dev, uint64_t blockno, const struct iovec *iov, int iovcnt)
+{
+  brwv(dev, blockno, iov, iovcnt, 1);
 }
 
 void TODO(){
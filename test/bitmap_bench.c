@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tatakos.h"
+
+/*
+ * Cross check and time the bitmap search kernels of bitmap.c. Random bitmaps
+ * (mostly full, mostly empty, or noise) of up to 64 Ki bits are searched from
+ * random starts by every kernel, which must agree with a search one bit at a
+ * time. So must bitmap_find_zero_run, bitmap_set and bitmap_clear. Then the
+ * time of a scan over a full 64 Ki bit map is printed for each kernel.
+ * It exits with 1 on a mismatch. make bench builds it with -O2 and runs it.
+ */
+
+/* the bits of the largest bitmap, a group of 64 KiB blocks */
+#define BENCH_BITS (64 * 1024)
+#define BENCH_ITERS 20000
+
+static uint8_t map[BENCH_BITS / 8], ref[BENCH_BITS / 8];
+
+static int usable(int k)
+{
+  return bitmap_impls[k].usable == 0 || bitmap_impls[k].usable();
+}
+
+static int bit(const uint8_t *m, int i)
+{
+  return (m[i >> 3] >> (i & 7)) & 1;
+}
+
+/* the reference search */
+static int find(const uint8_t *m, int start, int nbits, int b)
+{
+  int i;
+
+  for(i = start; i < nbits; i++)
+    if(bit(m, i) == b)
+      return i;
+  return -1;
+}
+
+static int find_zero_run(const uint8_t *m, int start, int nbits, int len)
+{
+  int i, k;
+
+  for(i = start; i + len <= nbits; i++){
+    for(k = 0; k < len && !bit(m, i + k); k++)
+      ;
+    if(k == len)
+      return i;
+  }
+  return -1;
+}
+
+/* fill map with one of the patterns */
+static void fill(int pattern)
+{
+  int i;
+
+  for(i = 0; i < sizeof(map); i++){
+    switch(pattern){
+    case 0: map[i] = 0xff; break;
+    case 1: map[i] = 0; break;
+    case 2: map[i] = rand() % 50 ? 0xff : rand(); break;
+    default: map[i] = rand() % 50 ? 0 : rand(); break;
+    }
+  }
+}
+
+/* return 0 if every usable kernel agrees with the reference */
+static int check(void)
+{
+  int it, k, nbits, start, len, got, want, bad = 0;
+
+  for(it = 0; it < BENCH_ITERS; it++){
+    nbits = rand() % (BENCH_BITS + 1);
+    start = rand() % (nbits + 2);
+    fill(it % 4);
+    for(k = 0; k < bitmap_nimpls; k++){
+      if(!usable(k))
+        continue;
+      if((got = bitmap_impls[k].find(map, start, nbits, 0)) != (want = find(map, start, nbits, 0))){
+        printf("%s: zero from %d of %d: %d, want %d\n", bitmap_impls[k].name, start, nbits, got, want);
+        bad = 1;
+      }
+      if((got = bitmap_impls[k].find(map, start, nbits, 1)) != (want = find(map, start, nbits, 1))){
+        printf("%s: one from %d of %d: %d, want %d\n", bitmap_impls[k].name, start, nbits, got, want);
+        bad = 1;
+      }
+    }
+    if(it % 20 == 0){
+      len = 1 + rand() % 40;
+      if((got = bitmap_find_zero_run(map, start, nbits, len)) != (want = find_zero_run(map, start, nbits, len))){
+        printf("zero run of %d from %d of %d: %d, want %d\n", len, start, nbits, got, want);
+        bad = 1;
+      }
+    }
+    if(it % 20 == 1){
+      /* set or clear a range, bit by bit in the reference */
+      memcpy(ref, map, sizeof(map));
+      start = rand() % BENCH_BITS;
+      len = rand() % (BENCH_BITS - start + 1);
+      if(it & 2)
+        bitmap_set(map, start, len);
+      else
+        bitmap_clear(map, start, len);
+      for(k = start; k < start + len; k++)
+        ref[k >> 3] = it & 2 ? ref[k >> 3] | 1 << (k & 7) : ref[k >> 3] & ~(1 << (k & 7));
+      if(memcmp(map, ref, sizeof(map))){
+        printf("%s of %d bits from %d\n", it & 2 ? "set" : "clear", len, start);
+        bad = 1;
+      }
+    }
+  }
+  return bad;
+}
+
+int main(int argc, char *argv[]){
+  clock_t c;
+  long sum;
+  int i, k;
+
+  if(check()){
+    printf("bitmap: kernels disagree\n");
+    return 1;
+  }
+  printf("bitmap: all kernels agree, bitmap_find_* use %s\n", bitmap_impl_name());
+
+  /* the only zero bit is the last one */
+  memset(map, 0xff, sizeof(map));
+  map[sizeof(map) - 1] = 0x7f;
+  for(k = 0; k < bitmap_nimpls; k++){
+    if(!usable(k))
+      continue;
+    c = clock();
+    sum = 0;
+    for(i = 0; i < 100000; i++)
+      sum += bitmap_impls[k].find(map, i & 7, BENCH_BITS, 0);
+    printf("%8s %8.1f ns per 64 Ki bit scan\n", bitmap_impls[k].name,
+           (double)(clock() - c) / CLOCKS_PER_SEC * 1e9 / 100000);
+    if(sum != 100000L * (BENCH_BITS - 1))
+      return 1;
+  }
+  return 0;
+}
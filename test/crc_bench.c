@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tatakos.h"
+
+/*
+ * Cross check and time the CRC32C kernels of crc32.c, from 4 B to 64 KiB,
+ * at an aligned and a misaligned address. Every kernel must agree with the
+ * byte-wise one (and give the check value of "123456789"), and so must
+ * crc32c_combine, crc32c_shift, crc32c_patch and the batch kernels. Then
+ * the GB/s of each is printed with the fastest one, and of crc32c_batch
+ * against one buffer at a time. It exits with 1 on a mismatch.
+ * make bench builds it with -O2 and runs it.
+ */
+
+#define BENCH_MAX (64 * 1024)
+/* how long each size is timed */
+#define BENCH_NSEC 20000000LL
+/* buffers in one crc32c_batch, as many as the inode scan verifies */
+#define BENCH_BATCH 32
+
+static unsigned char buf[BENCH_MAX + 64] __attribute__((aligned(64)));
+static unsigned char zero[64];
+static volatile uint32_t sink;
+
+static long long now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int usable(int k)
+{
+  return crc32c_impls[k].usable == 0 || crc32c_impls[k].usable();
+}
+
+/* return 0 if every usable kernel agrees with the byte-wise one */
+static int check(void)
+{
+  uint32_t want, got, seed;
+  int i, j, k, len, off, bad = 0;
+
+  for(k = 0; k < crc32c_nimpls; k++){
+    if(!usable(k))
+      continue;
+    if((got = ~crc32c_impls[k].crc(~0, (const unsigned char *)"123456789", 9)) != 0xe3069283){
+      printf("%s: check value %08x, want e3069283\n", crc32c_impls[k].name, got);
+      bad = 1;
+    }
+  }
+  for(len = 0; len <= BENCH_MAX; len = len < 64 ? len + 1 : len * 2 + 7){
+    if(len > BENCH_MAX)
+      len = BENCH_MAX;
+    for(off = 0; off < 8; off++){
+      seed = rand();
+      want = crc32c_bytewise(seed, buf + off, len);
+      for(k = 0; k < crc32c_nimpls; k++){
+        if(!usable(k))
+          continue;
+        if((got = crc32c_impls[k].crc(seed, buf + off, len)) != want){
+          printf("%s: len %d off %d: %08x, want %08x\n", crc32c_impls[k].name, len, off, got, want);
+          bad = 1;
+        }
+      }
+    }
+    if(len == BENCH_MAX)
+      break;
+  }
+
+  /* shifting, combining and patching agree with hashing the whole buffer */
+  for(len = 1; len <= BENCH_MAX; len = len * 3 + 1){
+    seed = rand();
+    off = rand() % len;
+    want = crc32c(seed, buf, len);
+    if(crc32c_combine(crc32c(seed, buf, off), crc32c(0, buf + off, len - off), len - off) != want){
+      printf("combine: len %d off %d\n", len, off);
+      bad = 1;
+    }
+    if(crc32c_shift(want, 64) != crc32c(want, zero, 64)){
+      printf("shift: len %d\n", len);
+      bad = 1;
+    }
+    /* the bytes from off on changed to the ones from buf + 1 + off */
+    got = crc32c(crc32c(seed, buf, off), buf + 1 + off, len - off);
+    want = crc32c(seed, buf, len);
+    if(crc32c_patch(want, buf + off, buf + 1 + off, len - off, 0) != got){
+      printf("patch: len %d off %d\n", len, off);
+      bad = 1;
+    }
+  }
+
+  /* a batch of buffers of mixed lengths and alignments */
+  for(i = 0; i < 200; i++){
+    uint32_t crc[BENCH_BATCH], seeds[BENCH_BATCH];
+    const void *p[BENCH_BATCH];
+    unsigned int l[BENCH_BATCH];
+    int n = rand() % BENCH_BATCH + 1;
+
+    for(k = 0; k < n; k++){
+      l[k] = i & 1 ? rand() % 300 : rand() % (BENCH_MAX - 8);
+      p[k] = buf + rand() % 8;
+      crc[k] = seeds[k] = rand();
+    }
+    for(k = 0; k < crc32c_nimpls; k++){
+      if(!usable(k) || !crc32c_impls[k].batch)
+        continue;
+      for(j = 0; j < n; j++)
+        crc[j] = seeds[j];
+      crc32c_impls[k].batch(crc, p, l, n);
+      for(j = 0; j < n; j++)
+        if(crc[j] != crc32c_bytewise(seeds[j], p[j], l[j])){
+          printf("%s batch: %d of %d, len %u\n", crc32c_impls[k].name, j, n, l[j]);
+          bad = 1;
+        }
+    }
+  }
+  return bad;
+}
+
+/* GB/s of kernel k on len bytes at buf + off */
+static double speed(int k, int len, int off)
+{
+  long long t0, t, n = 0, iters = 1, i;
+  uint32_t crc = ~0;
+
+  t0 = now();
+  do {
+    for(i = 0; i < iters; i++)
+      crc = crc32c_impls[k].crc(crc, buf + off, len);
+    n += iters;
+    iters *= 2;
+    t = now() - t0;
+  } while(t < BENCH_NSEC);
+  sink = crc;
+  return (double)n * len / t;
+}
+
+/*
+ * GB/s of crc32c_batch (batch = 1) or of crc32c one buffer at a time on
+ * BENCH_BATCH buffers of len bytes, like the inodes of an inode table.
+ */
+static double speed_batch(int len, int batch)
+{
+  static uint32_t crc[BENCH_BATCH];
+  const void *p[BENCH_BATCH];
+  unsigned int l[BENCH_BATCH];
+  long long t0, t, n = 0, iters = 1, i;
+  int j;
+
+  for(j = 0; j < BENCH_BATCH; j++){
+    p[j] = buf + (j * len) % (BENCH_MAX - len + 1);
+    l[j] = len;
+  }
+  t0 = now();
+  do {
+    for(i = 0; i < iters; i++){
+      if(batch)
+        crc32c_batch(crc, p, l, BENCH_BATCH);
+      else
+        for(j = 0; j < BENCH_BATCH; j++)
+          crc[j] = crc32c(crc[j], p[j], l[j]);
+    }
+    n += iters;
+    iters *= 2;
+    t = now() - t0;
+  } while(t < BENCH_NSEC);
+  sink = crc[0];
+  return (double)n * BENCH_BATCH * len / t;
+}
+
+int main(int argc, char *argv[]){
+  static const int offs[] = { 0, 1 };
+  double gbs, best;
+  int i, k, len, o, fastest = -1;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = rand();
+  if(check()){
+    printf("crc32c: kernels disagree\n");
+    return 1;
+  }
+  printf("crc32c: all kernels agree, crc32c() uses %s\n", crc32c_impl_name());
+
+  printf("%8s %6s", "bytes", "align");
+  for(k = 0; k < crc32c_nimpls; k++)
+    if(usable(k))
+      printf(" %9s", crc32c_impls[k].name);
+  printf("   GB/s\n");
+  for(len = 4; len <= BENCH_MAX; len *= 4){
+    for(o = 0; o < sizeof(offs) / sizeof(offs[0]); o++){
+      printf("%8d %6s", len, offs[o] ? "+1" : "64");
+      best = 0;
+      for(k = 0; k < crc32c_nimpls; k++){
+        if(!usable(k))
+          continue;
+        gbs = speed(k, len, offs[o]);
+        printf(" %9.2f", gbs);
+        /* the block sized runs decide */
+        if(len == 4096 && o == 0 && gbs > best){
+          best = gbs;
+          fastest = k;
+        }
+      }
+      printf("\n");
+    }
+  }
+  printf("fastest on 4 KiB blocks: CRC32C_IMPL=%s\n", crc32c_impls[fastest].name);
+
+  printf("\n%8s %9s %9s   GB/s of %d buffers with %s\n", "bytes", "one", "batch", BENCH_BATCH, crc32c_impl_name());
+  for(len = 64; len <= BENCH_MAX; len *= 4)
+    printf("%8d %9.2f %9.2f\n", len, speed_batch(len, 0), speed_batch(len, 1));
+  return 0;
+}
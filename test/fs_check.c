@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tatakos.h"
+#include "ext4.h"
+
+/*
+ * Run the paths of the file system on a scratch image and check what they
+ * leave behind: the inode cache, the inode table scan (also two at once), the creation of an
+ * inode, the buffered writes with delayed allocation (and so the allocator
+ * and the preallocation windows), the read back before and after the flush
+ * and a remount (also in pieces smaller than a block, which must widen the
+ * readahead window), the writes into more holes than the extent tree has
+ * room for, and the statfs counts. e2fsck -fn must find the image clean
+ * after ext4_sync and after umount. make check runs it on new images of several block sizes. It
+ * exits with 1 on a failure.
+ */
+
+/* the size of the file written, in blocks */
+#define CHECK_BLOCKS 300
+/* the writes into separate holes, more than the extents of an inode */
+#define CHECK_SPARSE 6
+
+static int failed;
+
+#define CHECK(cond, ...)                      \
+  do {                                        \
+    if(!(cond)){                              \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__);                    \
+      printf("\n");                           \
+      failed = 1;                             \
+    }                                         \
+  } while(0)
+
+/*
+ * The counts of in-use inodes seen by a scan, used[ino] is set for each.
+ * Each inode must be the one read through the inode cache, the scan reads
+ * the inode table, so the cached inodes (not the bitmaps) are synced first.
+ * The checksums are set in the table only and are not compared.
+ */
+static int scan(char *used, __u32 *last)
+{
+  struct ext4_iscan s;
+  ext4_inode_t *p, inode;
+  __u32 ino;
+  int n = 0;
+
+  *last = 0;
+  ext4_isync();
+  ext4_iscan_start(&s);
+  while((p = ext4_iscan_next(&s, &ino))){
+    ext4_rw_ondisk_inode(ino, &inode, EXT4_READ);
+    inode.osd2.linux2.l_i_checksum_lo = p->osd2.linux2.l_i_checksum_lo;
+    inode.i_checksum_hi = p->i_checksum_hi;
+    CHECK(memcmp(p, &inode, sizeof(inode)) == 0, "inode %u of the scan differs from the cached one", ino);
+    if(used)
+      used[ino] = 1;
+    *last = ino;
+    n++;
+  }
+  ext4_iscan_end(&s);
+  return n;
+}
+
+/* a scan from another thread, for the count only */
+static void *scan_thread(void *arg)
+{
+  __u32 last;
+
+  return (void *)(long)scan(0, &last);
+}
+
+/* read the file ino back into buf */
+static int read_back(__u32 ino, void *buf, int len)
+{
+  struct ext4_ra ra;
+
+  memset(&ra, 0, sizeof(ra));
+  return ext4_read(ino, &ra, 0, buf, len);
+}
+
+/* e2fsck -fn must find the image clean */
+static void fsck(const char *path, const char *when)
+{
+  char cmd[256];
+  int rc;
+
+  snprintf(cmd, sizeof(cmd), "e2fsck -fn %s > /dev/null 2>&1", path);
+  rc = system(cmd);
+  if(WEXITSTATUS(rc) == 127)
+    printf("e2fsck not found, the image is not checked\n");
+  else
+    CHECK(rc == 0, "e2fsck -fn %s failed %s", path, when);
+}
+
+int main(int argc, char *argv[]){
+  struct ext4_statfs st0, st;
+  struct ext4_ra ra;
+  pthread_t th[2];
+  void *ret;
+  ext4_inode_t root, inode;
+  ext4_extent_header_t *peh;
+  ext4_minode_t *ip;
+  char *used0, *used;
+  uint8_t *data, *got;
+  __u32 ino = 0, last, i, mtime;
+  int n, len, rc, room;
+
+  if(argc < 2){
+    printf("usage: %s scratch.img\n", argv[0]);
+    return 1;
+  }
+  if(ext4_mount(0, argv[1], 0) < 0)
+    return 1;
+  ext4_statfs(&st0);
+  used0 = calloc(st0.f_files + 1, 1);
+  used = calloc(st0.f_files + 1, 1);
+
+  /* the scan sees the in-use inodes, the super block counts them */
+  n = scan(used0, &last);
+  CHECK(n == st0.f_files - st0.f_ffree, "scan found %d inodes, statfs says %u", n, st0.f_files - st0.f_ffree);
+
+  /* an inode changed in the cache reaches the inode table */
+  ip = ext4_iget(EXT4_ROOT_DIR_INODE_NUM);
+  mtime = ++ip->d.i_mtime;
+  ext4_idirty(ip);
+  ext4_iput(ip);
+  ext4_isync();
+  ext4_rw_ondisk_inode(EXT4_ROOT_DIR_INODE_NUM, &root, EXT4_READ);
+  CHECK(root.i_mtime == mtime, "root mtime %u, want %u", root.i_mtime, mtime);
+
+  /* a new inode, the scan sees it before the bitmaps are synced */
+  ext4_create_inode(&root, S_IFREG);
+  ext4_statfs(&st);
+  CHECK(st.f_ffree == st0.f_ffree - 1, "free inodes %u, want %u", st.f_ffree, st0.f_ffree - 1);
+  n = scan(used, &last);
+  CHECK(n == st0.f_files - st0.f_ffree + 1, "scan found %d inodes after create", n);
+  for(i = 1; i <= st0.f_files; i++)
+    if(used[i] && !used0[i])
+      ino = i;
+  CHECK(ino != 0 && last >= ino, "the new inode is not found by the scan, the last one is %u", last);
+  if(ino == 0)
+    return 1;
+
+  /* a file of CHECK_BLOCKS blocks and a bit, written with delayed allocation */
+  len = CHECK_BLOCKS * st.f_bsize + 123;
+  data = malloc(len);
+  got = malloc(len);
+  for(n = 0; n < len; n++)
+    data[n] = rand();
+  ext4_statfs(&st0);
+  for(n = 0; n < len; n += 5000)
+    CHECK(ext4_write(ino, n, data + n, len - n < 5000 ? len - n : 5000) > 0, "write at %d", n);
+  ext4_statfs(&st);
+  CHECK(st.f_bfree <= st0.f_bfree - CHECK_BLOCKS, "free blocks %llu after the write, had %llu",
+        (unsigned long long)st.f_bfree, (unsigned long long)st0.f_bfree);
+  /* the delayed blocks are read before they are allocated */
+  memset(got, 0, len);
+  CHECK(read_back(ino, got, len) == len && memcmp(got, data, len) == 0, "read before flush differs");
+  ext4_da_flush(ino);
+  memset(got, 0, len);
+  CHECK(read_back(ino, got, len) == len && memcmp(got, data, len) == 0, "read after flush differs");
+
+  /* overwrite the mapped blocks in the middle, not on block boundaries */
+  for(n = 1000; n < len / 2; n++)
+    data[n] ^= 0x5a;
+  CHECK(ext4_write(ino, 1000, data + 1000, len / 2 - 1000) == len / 2 - 1000, "overwrite");
+  memset(got, 0, len);
+  CHECK(read_back(ino, got, len) == len && memcmp(got, data, len) == 0, "read after overwrite differs");
+  /* the preallocation window was given back by the flush */
+  ext4_statfs(&st0);
+  ext4_umount();
+
+  /* everything is on the disk */
+  if(ext4_mount(0, argv[1], 0) < 0)
+    return 1;
+  ext4_statfs(&st);
+  CHECK(st.f_bfree == st0.f_bfree && st.f_ffree == st0.f_ffree, "statfs changed over a remount: %llu/%u free, had %llu/%u",
+        (unsigned long long)st.f_bfree, st.f_ffree, (unsigned long long)st0.f_bfree, st0.f_ffree);
+  /* two scans at once load the inode bitmaps of the new mount together */
+  pthread_create(&th[0], 0, scan_thread, 0);
+  pthread_create(&th[1], 0, scan_thread, 0);
+  for(i = 0; i < 2; i++){
+    pthread_join(th[i], &ret);
+    CHECK((long)ret == st.f_files - st.f_ffree, "a scan beside another found %ld inodes, want %u",
+          (long)ret, st.f_files - st.f_ffree);
+  }
+  ext4_rw_ondisk_inode(ino, &inode, EXT4_READ);
+  CHECK((inode.i_size_lo | (uint64_t)inode.i_size_high << 32) == len, "size %u, want %d", inode.i_size_lo, len);
+  memset(got, 0, len);
+  CHECK(read_back(ino, got, len) == len && memcmp(got, data, len) == 0, "read after remount differs");
+  /* a stream of reads smaller than a block widens the readahead window too */
+  memset(&ra, 0, sizeof(ra));
+  for(n = 0; n < len && (rc = ext4_read(ino, &ra, n, got + n, 1000)) > 0; n += rc)
+    ;
+  CHECK(n == len && memcmp(got, data, len) == 0, "read in small pieces differs");
+  CHECK(ra.window == EXT4_RA_MAX_BLOCKS, "readahead window %u after a small read stream", ra.window);
+
+  /*
+   * Writes into separate holes behind the end, each needs an extent of its
+   * own: the ones the extent tree has no room for are refused, the others
+   * are synced and read back. The sync gives back the windows, so the image
+   * is clean while mounted.
+   */
+  ext4_rw_ondisk_inode(ino, &inode, EXT4_READ);
+  peh = (ext4_extent_header_t *)inode.i_block;
+  room = peh->eh_max - peh->eh_entries;
+  for(n = 0; n < CHECK_SPARSE; n++){
+    rc = ext4_write(ino, (uint64_t)(len / st.f_bsize + 10 + 20 * n) * st.f_bsize, "abc", 3);
+    CHECK(rc == (n < room ? 3 : -1), "sparse write %d returned %d, room for %d extents", n, rc, room);
+  }
+  ext4_sync();
+  for(n = 0; n < CHECK_SPARSE && n < room; n++){
+    memset(got, 0, 3);
+    ext4_read(ino, 0, (uint64_t)(len / st.f_bsize + 10 + 20 * n) * st.f_bsize, got, 3);
+    CHECK(memcmp(got, "abc", 3) == 0, "sparse write %d differs", n);
+  }
+  fsck(argv[1], "after ext4_sync");
+  ext4_umount();
+  fsck(argv[1], "after umount");
+
+  printf("%s: %s\n", argv[1], failed ? "FAILED" : "ok");
+  free(used0);
+  free(used);
+  free(data);
+  free(got);
+  return failed;
+}
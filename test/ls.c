@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include "tatakos.h"
+#include "ext4.h"
+#include "stdlib.h"
+
+/* list the root directory of an image, the image is mapped read only */
+int main(int argc, char *argv[]){
+  ext4_inode_t *proot_inode = kmalloc(sizeof(ext4_inode_t));
+  void *buf;
+  const char *img = argc > 1 ? argv[1] : "ext4_fs.img";
+
+  if(ext4_mount(0, img, BDEV_MMAP) < 0)
+    return 1;
+  /* the block size is known after mount */
+  buf = kmalloc(EXT4_BLOCK_SIZE);
+
+  ext4_rw_ondisk_inode(EXT4_ROOT_DIR_INODE_NUM, proot_inode, EXT4_READ);
+  ext4_readdir(proot_inode, 0, buf, EXT4_BLOCK_SIZE);
+
+  ext4_umount();
+  kfree(proot_inode);
+  kfree(buf);
+}
@@ -6,17 +6,22 @@
 extern ext4_super_block_t es;
 /* The descriptors of block group.
 The number of block groups is the size of the device divided by the size of a block group. */
-extern ext4_group_desc_t egd[EXT4_MAX_BG_CNT];
+extern ext4_group_desc_t *egd;
 /* The counts of block group */
 extern int bg_cnts;
 
 
-int main(){
+int main(int argc, char *argv[]){
   ext4_inode_t *proot_inode = kmalloc(sizeof(ext4_inode_t));
-  void *buf = kmalloc(EXT4_BLOCK_SIZE);
+  void *buf;
+  /* the image can be given on the command line */
+  const char *img = argc > 1 ? argv[1] : "ext4_fs.img";
 
   // ext4_fill_super();
-  ext4_rw_ondisk_super_bgd(EXT4_READ);
+  if(ext4_mount(0, img, 0) < 0)
+    return 1;
+  /* the block size is known after mount */
+  buf = kmalloc(EXT4_BLOCK_SIZE);
 
   // ext4_rw_ondisk_block(1, buf, EXT4_READ);
   // ext4_rw_ondisk_block(307200000, buf, EXT4_READ);
@@ -32,7 +37,7 @@ int main(){
   // ext4_create_inode(proot_inode, T_FILE);
   ext4_create_inode(proot_inode, S_IFREG);
   
-  ext4_rw_ondisk_super_bgd(EXT4_WRITE);
+  ext4_umount();
   kfree(proot_inode);
   kfree(buf);
 }
\ No newline at end of file